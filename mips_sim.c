@@ -3,25 +3,106 @@
  */
 
  /* ======================== Preprocessor Directives ======================== */
+#define _GNU_SOURCE // open_memstream, strdup
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
 #include <limits.h>
 #include <math.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 
 #define SINGLE 1
 #define BATCH 0
 #define REG_NUM 32
+#define IM_SIZE 512
+#define DM_SIZE 2048
+
+// input formats: assembly text, raw MIPS32 words (big or little endian) or ELF
+#define FMT_ASM 0
+#define FMT_RAW 1
+#define FMT_RAWEL 2
+#define FMT_ELF 3
+
+// number of m/n/c configurations the sweep engine advances together, one
+// 32-bit lane each, so one AVX2 register's worth
+#ifndef LANES
+#define LANES 8
+#endif
+
+// the sweep kernel is also compiled for AVX2 and picked at run time, so a
+// build for the baseline x86-64 still gets full-width lanes on AVX2 hosts
+#if defined(__x86_64__) && !defined(__AVX2__)
+#define SWEEP_TARGETS __attribute__((target_clones("avx2", "default")))
+#else
+#define SWEEP_TARGETS
+#endif
+
+// trace words the sweep engine holds at a time; a longer run is traced again
+// for each group of lanes, a chunk at a time, so lane indices stay small and
+// the trace takes the same memory however long the program runs
+#define TRACE_CHUNK 65536
+
+// how many retired instructions loop detection remembers, which bounds the
+// length of a loop iteration it can skip
+#define PATH_SIZE 4096
+
+// most cores a multi-core run simulates, and how many times a core polls the
+// clock of a core it waits for before yielding its host CPU
+#define MAX_CORES 64
+#define WAIT_SPINS 256
+
+// clock a core publishes once it has halted, later than any real cycle
+#define CORE_HALTED (LONG_MAX >> 2)
+
+// most line fills the instruction cache has under way at once; the
+// prefetcher drops lines while they're all busy
+#define ICACHE_FILLS 4
+
+// latency tuples (m, n, c) that get a simulator loop compiled for them, as a
+// list of X(m, n, c); any other configuration runs the generic loop
+#ifndef SPECIALIZED_LATENCIES
+#define SPECIALIZED_LATENCIES(X) X(1, 1, 1) X(2, 1, 1) X(4, 1, 2) X(2, 2, 2) \
+    X(4, 2, 4)
+#endif
+
+// storage class of state each simulated core keeps to itself; every core of a
+// multi-core run is simulated on its own host thread
+#define PER_CORE _Thread_local
 
 // helper macro that fills in redundant information for an error call
 #define PARSER_ERR(msg, inst, col, ...) parserErr(__FUNCTION__, __LINE__, msg, \
     inst, col, ##__VA_ARGS__)
 
+// helper macro for errors raised while the program is running
+#define SIM_ERR(msg, ...) simErr(__FUNCTION__, __LINE__, msg, ##__VA_ARGS__)
+
+// charges one cycle to a profiler counter of the instruction at IM index
+#define PROFILE(index, field) do { \
+        if (Profile) Profile[index].field++; \
+    } while (0)
+
+// observer hooks are only compiled in when SIM_HOOKS names the file that
+// defines them, e.g. -DSIM_HOOKS='"coverage.c"'; otherwise HOOK and
+// HOOK_CYCLE expand to nothing and the stages are exactly as without them
+#ifdef SIM_HOOKS
+#define MAX_HOOKS 8
+#define HOOK(point, inst) runHooks(point, inst)
+#define HOOK_CYCLE(cycle) (Hook_Cycle = (cycle))
+#else
+#define HOOK(point, inst) do { } while (0)
+#define HOOK_CYCLE(cycle) do { } while (0)
+#endif
+
 /* ============================ Structs and Enums =========================== */
 /**
  * Represents an instruction operation.
@@ -48,6 +129,40 @@ enum inst_type {
     I_TYPE // immediate/branch
 };
 
+/**
+ * Points in the life of an instruction that observer hooks can watch.
+ */
+enum hook_point {
+    HOOK_FETCH, // IF sent it to ID
+    HOOK_DECODE, // ID (or dispatch) read the operands available to it
+    HOOK_ISSUE, // it started executing, operands in rs and rt
+    HOOK_EXECUTE, // its EX result is computed; beq is still BEQ, taken if 0
+    HOOK_MEMORY, // a load or store is about to access the address EX_result
+    HOOK_WRITEBACK, // it retired, after any register write
+    HOOK_COUNT
+};
+
+/**
+ * Pipeline stage holding the youngest in-flight writer of a register, as
+ * tracked by the scoreboard.
+ */
+enum stage {
+    STAGE_NONE, // no write pending
+    STAGE_EX,
+    STAGE_MEM,
+    STAGE_WB
+};
+
+/**
+ * Functional units of the out-of-order back end.
+ */
+enum unit {
+    UNIT_ALU, // add, addi, sub and beq in n cycles
+    UNIT_MUL, // mul in m cycles
+    UNIT_LS, // address generation in n cycles, plus c for loads
+    UNIT_COUNT
+};
+
 /**
  * Represents a single instruction to the processor.
  */
@@ -63,16 +178,209 @@ struct inst {
     int16_t EX_result;
     // immediate or offset value for I-Type instructions
     int16_t immediate;
+    // IM index the instruction was fetched from
+    int16_t index;
+};
+
+/**
+ * An instruction as stored in IM. Only register indices live here, so it
+ * packs into 8 bytes and IF expands it into a struct inst on fetch.
+ */
+struct im_inst {
+    uint8_t op; // enum inst_op
+    uint8_t type; // enum inst_type
+    uint8_t rs;
+    uint8_t rt;
+    uint8_t rd;
+    int16_t immediate;
+};
+_Static_assert(sizeof(struct im_inst) == 8, "IM entries should stay packed");
+
+/**
+ * One dynamically executed instruction, as replayed by the sweep engine.
+ * Branch outcomes don't depend on latencies, so every configuration in a
+ * sweep sees the same stream and only needs the op and its registers: the op
+ * in bits 0-3, then the register written and the two read in five bits each,
+ * with $zero standing for none since it's never a hazard.
+ */
+typedef uint32_t trace_t;
+#define TRACE_OP(word) ((word) & 15)
+#define TRACE_DST(word) (((word) >> 4) & 31)
+#define TRACE_SRC1(word) (((word) >> 9) & 31)
+#define TRACE_SRC2(word) (((word) >> 14) & 31)
+#define TRACE_WAIT 15 // op past the end of a chunk that isn't the last
+
+/**
+ * Running sums over the detailed windows of a sampled simulation, used to
+ * extrapolate whole-program CPI and utilization.
+ */
+struct sample_stats {
+    long instructions; // every instruction executed, detailed or not
+    long windows; // windows with at least one measured instruction
+    // CPI followed by IF, ID, EX, MEM and WB utilization for each window
+    double sum[6];
+    double sumSq[6];
+};
+
+/**
+ * Buffered writer for the utilization time series. Records are accumulated in
+ * buffer and written out whenever it fills, so memory use doesn't grow with
+ * the length of the run.
+ *
+ * The binary format is the magic "MIPSTL2" plus NUL and the interval as a
+ * little-endian uint64, followed by one record per interval of eleven
+ * little-endian uint64s: the cycle the interval ends on, then the IF, ID, EX,
+ * MEM and WB work cycles, retired instructions, RAW, branch and structural
+ * stall cycles, and the cycle count of the interval.
+ *
+ * Work is credited per cycle, including the cycles already spent on the
+ * instruction a stage holds, so no interval shows more than 100% utilization.
+ */
+struct timeline {
+    FILE *file;
+    int binary;
+    long interval; // cycles per record
+    long lastCycle; // cycle the previous record ended on
+    long last[9]; // counters as of the previous record
+    size_t used;
+    char buffer[1 << 16];
+};
+
+/**
+ * Cycles and stalls the profiler charged to one IM entry.
+ */
+struct profile_entry {
+    long executions; // times it retired
+    long cycles[5]; // cycles it occupied IF, ID, EX, MEM and WB
+    long rawStalls; // cycles ID waited on its operands
+    long branchStalls; // cycles IF froze behind it
+    long structuralStalls; // cycles it waited on a full latch
+};
+
+/**
+ * Timing state of the in-order pipeline when a backward branch is taken.
+ * Everything that decides how the following cycles play out is here, but no
+ * data values, so equal keys an iteration apart mean the loop has settled
+ * into a steady state.
+ */
+struct loop_key {
+    long PC;
+    long ifCycles, exCycles, memCycles;
+    int flags[6]; // IF/ID, ID/EX, EX/MEM and MEM/WB occupancy, halts
+    int16_t index[4]; // IM index in each occupied latch
+    uint8_t op[4]; // op in each occupied latch, beq once resolved differs
+    uint32_t pending;
+    uint8_t producer[REG_NUM];
+};
+
+/**
+ * Reorder buffer entry of the out-of-order back end.
+ */
+struct rob_entry {
+    struct inst inst; // rs and rt hold operand values once they're known
+    int done; // EX_result holds the result, or the address for a store
+};
+
+/**
+ * Reservation station of the out-of-order back end.
+ */
+struct rs_entry {
+    int busy;
+    int issued; // started on a functional unit
+    int rob; // ROB index of the instruction
+    int qj, qk; // ROB indices rs and rt are waiting on, -1 once ready
+};
+
+/**
+ * One core of a multi-core run. The state is published at the start of every
+ * cycle for the cores waiting on it; the rest is copied out of the core's
+ * thread once it has halted.
+ */
+struct core {
+    pthread_t thread;
+    // cycle the core is on (every earlier one is done) << 2, with bit 1 set
+    // if it has a load or store waiting in MEM and bit 0 if it's partway
+    // through an access and keeps the bus
+    atomic_long state;
+    long cycles; // cycle halt passed WB on
+    long work[5]; // IF, ID, EX, MEM and WB work cycles
+    long retired;
+    long busStalls; // cycles MEM waited for another core's access
+    long registers[REG_NUM];
+    long PC;
+} __attribute__((aligned(64)));
+
+/**
+ * Line of the instruction cache.
+ */
+struct icache_line {
+    long tag; // line number (byte address / line size), -1 when invalid
+    long ready; // IF cycle its fill completes on
+    int prefetched; // brought in by the prefetcher and not fetched from yet
+};
+
+/**
+ * Instruction cache of IF with a next-line prefetcher. Each set keeps its
+ * ways in LRU order, most recently used first. A hit takes one cycle, a miss
+ * missLatency, and fetching from a line whose fill is still under way waits
+ * for the rest of it.
+ */
+struct icache {
+    int sets, ways, lineSize, missLatency;
+    int prefetch; // lines after the one fetched from to prefetch
+    long now; // cycles IF has run
+    long hits, misses;
+    long prefetches; // fills the prefetcher started
+    long usefulPrefetches; // prefetched lines later fetched from
+    long latePrefetches; // useful ones whose fill wasn't done in time
+    long fills[ICACHE_FILLS]; // IF cycle each fill slot frees up after
+    struct icache_line *lines; // sets x ways
+};
+
+/**
+ * Per-lane vector used by the sweep engine, one lane per configuration.
+ * Comparisons produce -1 in lanes where they hold, which doubles as the mask
+ * for blend(). The alignment is spelled out because a build without AVX only
+ * gives these 16 bytes, while the AVX2 clone of the kernel assumes their full
+ * size.
+ */
+typedef int32_t lane_t __attribute__((vector_size(LANES * sizeof(int32_t)),
+        aligned(LANES * sizeof(int32_t))));
+
+/**
+ * Per-lane 64-bit counters, so cycle and work counts of long runs don't wrap
+ * the way a 32-bit lane would.
+ */
+typedef int64_t wide_t __attribute__((vector_size(LANES * sizeof(int64_t)),
+        aligned(LANES * sizeof(int64_t))));
+
+/**
+ * Struct-of-arrays pipeline state for LANES configurations. Latches hold the
+ * op and register masks of their instruction instead of a full struct inst.
+ */
+struct lanes {
+    lane_t m, n, c; // latencies for each configuration
+    lane_t live; // -1 until halt has passed WB
+    lane_t ifIdx; // index into the chunk of the next instruction to fetch
+    lane_t ifNext; // the trace word at ifIdx
+    lane_t ifHalt; // -1 once halt has been fetched
+    lane_t ifCycles, exCycles, memCycles;
+    lane_t ifIdFlag, idExFlag, exMemFlag, memWbFlag;
+    lane_t ifIdOp, idExOp, exMemOp, memWbOp;
+    lane_t ifIdDst, idExDst, exMemDst, memWbDst, ifIdSrc;
+    // counted in 32 bits per cycle and added to the wide counts in blocks
+    lane_t ifAcc, idAcc, exAcc, memAcc, wbAcc, cycleAcc;
+    wide_t ifWork, idWork, exWork, memWork, wbWork, cycles;
 };
 
 /* ======================= Parsing Function Prototypes ====================== */
 /**
- * Reads input from a text file and returns the string as a list of space
- * separated tokens.
+ * Reads the next instruction from a text file and returns it as a list of
+ * space separated tokens, or NULL at the end of the file.
  * Treats consecutive commas as a single comma.
  * Asserts proper parenthesis format for loads and stores.
  */
-char *progScanner();
+char *progScanner(FILE *input);
 
 /**
  * Takes as input the output of progScanner and returns a string with registers
@@ -91,6 +399,28 @@ char *regNumberConverter(char *instruction);
  */
 struct inst parser(char *instruction);
 
+/**
+ * Starts parsing the assembly in input into IM on a producer thread, so the
+ * pipeline can run while the rest of the program is still being read; IF
+ * waits for instructions that aren't there yet.
+ */
+void streamProgram(FILE *input);
+
+/**
+ * Called once halt has passed WB. A file is parsed to the end so every
+ * instruction after halt is checked too; a pipe may come from a generator
+ * that never closes it, so its producer is cancelled instead. A parse error
+ * the producer hit is reported here.
+ */
+void streamFinish(FILE *input);
+
+/**
+ * Loads MIPS32 machine code into IM, either a raw stream of words in the
+ * byte order given by format or the .text section of an ELF file.
+ * Accepts add(u), sub(u), mul, addi(u), beq, lw, sw, nop and break (as halt).
+ */
+void loadBinary(FILE *input, int format);
+
 /**
  * Fetches from instruction memory.
  * Freezes if there's an unresolved branch.
@@ -122,6 +452,147 @@ void MEM(void);
  */
 void WB(void);
 
+/**
+ * Runs the in-order pipeline from sim_cycle until halt passes WB and
+ * returns the cycle count, using a loop compiled for the current latencies
+ * if they're one of SPECIALIZED_LATENCIES. For batch runs without
+ * --timeline or --ooo.
+ */
+long runPipeline(long sim_cycle);
+
+/**
+ * Puts an instruction cache of size bytes in front of IM with the given
+ * associativity, line size in bytes and miss latency, prefetching the next
+ * prefetch lines on every fetch. IF then no longer takes c cycles per fetch.
+ */
+void icacheInit(int size, int ways, int lineSize, int missLatency,
+        int prefetch);
+
+/**
+ * Writes the instruction cache hit, miss and prefetch counters.
+ */
+void icacheReport(FILE *output);
+
+/**
+ * Runs the loaded program on the architectural state only for up to
+ * TRACE_CHUNK more instructions, stores them in chunk and returns how many.
+ * The entry after them is halt once the program has reached it and
+ * TRACE_WAIT otherwise.
+ */
+long traceChunk(trace_t *chunk);
+
+/**
+ * Opens a timeline that records every interval cycles to path, as CSV or in
+ * the binary format described at struct timeline. Returns NULL if path can't
+ * be created.
+ */
+struct timeline *timelineOpen(const char *path, long interval, int binary);
+
+/**
+ * Appends a record covering the cycles since the previous one.
+ */
+void timelineRecord(struct timeline *tl, long sim_cycle);
+
+/**
+ * Records any partial interval at the end of the run, flushes and closes.
+ */
+void timelineClose(struct timeline *tl, long sim_cycle);
+
+/**
+ * Sets up the out-of-order back end with the given number of reservation
+ * stations, reorder buffer entries and commit width.
+ */
+void oooInit(int rsSize, int robSize, int width);
+
+/**
+ * Simulates one cycle of the out-of-order core: commit, execute, issue and
+ * dispatch in reverse like the in-order stages, then IF.
+ * Registers and DM are only written at commit, so they stay precise.
+ */
+void oooCycle(void);
+
+/**
+ * Writes IPC, occupancy and stall statistics of an out-of-order run.
+ */
+void oooReport(FILE *output, long sim_cycle);
+
+/**
+ * Writes the profile as the program listing annotated with execution counts,
+ * stage cycles and stalls per line. Assembly is listed from the lines
+ * progScanner kept, so the listing matches the original text even when it
+ * was piped in; machine code is disassembled.
+ */
+void profileListing(FILE *listing, int format, const char *program,
+        long sim_cycle);
+
+/**
+ * Writes the profile as folded stacks (program;instruction;stage cycles),
+ * the input format of flamegraph.pl and tools compatible with it. Stall
+ * cycles get frames of their own next to the stages.
+ */
+void profileFolded(FILE *folded, const char *program);
+
+/**
+ * Called at the end of a cycle in which EX took a backward branch. Once the
+ * pipeline is in the same timing state as at the previous such branch, it
+ * checks functionally how many more iterations follow the same path, runs
+ * them on the architectural state only and advances sim_cycle and the
+ * counters by as many iterations' worth, leaving the pipeline exactly where
+ * detailed simulation would have.
+ */
+void loopSync(long *sim_cycle);
+
+/**
+ * Simulates the loaded program by alternating functional fast-forward with
+ * detailed pipeline windows. Every period instructions, warmup instructions
+ * refill the latches and the next window instructions are measured into
+ * stats.
+ */
+void sampleProgram(long period, long window, long warmup,
+        struct sample_stats *stats);
+
+/**
+ * Simulates count copies of the pipeline, each on its own host thread, that
+ * share DM. Core k starts at PC 0 with its number in $k0. DM is behind a
+ * single bus granted round robin one cycle at a time, so only one core
+ * accesses DM in any cycle. Cores run ahead of each other freely and a core
+ * only waits when MEM wants the bus, until every other core has reached the
+ * same cycle; the grants, and so the results, are the same as if the cores
+ * ran in lockstep. Results are left in Cores.
+ */
+void runCores(int count);
+
+#ifdef SIM_HOOKS
+/**
+ * Observer hook, called with the instruction, the cycle and the data it was
+ * registered with. Hooks see instructions simulated in detail only, not
+ * fast-forwarded ones or skipped loop iterations, and in a sampled run
+ * cycles count from the start of the window. Hooks of a multi-core run are
+ * called on each core's thread.
+ */
+typedef void (*hook_fn)(const struct inst *inst, long cycle, void *data);
+
+/**
+ * Registers fn to be called at point, after any hooks already there; up to
+ * MAX_HOOKS per point.
+ */
+void addHook(enum hook_point point, hook_fn fn, void *data);
+
+/**
+ * Defined by the SIM_HOOKS file and called once the program is loaded, to
+ * register its hooks (and an atexit handler to report, if it needs one).
+ */
+void hooksInit(void);
+#endif
+
+/**
+ * Simulates up to LANES configurations of the pipeline in lockstep over the
+ * program from the current architectural state, traced with traceChunk into
+ * trace, which holds TRACE_CHUNK + 1 words. Lanes past count are left idle.
+ */
+void sweepLanes(struct lanes *lanes, trace_t *trace,
+        const int *configs, int count);
+
 // regNumberConverter helper functions
 static char *getRegNumber(char *token, char *base, char *original);
 
@@ -137,6 +608,101 @@ static long Strtol(char **numStr, int min, int max, char *inst, long col);
 static void parserErr(const char *function, int line, const char *msg,
                       const char *inst, long col, ...);
 
+// loader helper functions
+static void *parseProgram(void *input);
+static int imWait(long index);
+static void imCheck(void);
+static struct im_inst packInst(const struct inst *inst);
+static struct inst unpackInst(const struct im_inst *inst);
+static struct im_inst decodeWord(uint32_t word, long index);
+static uint32_t readWord(const uint8_t *bytes, int bigEndian);
+static uint16_t readHalf(const uint8_t *bytes, int bigEndian);
+
+// pipeline helper functions
+static inline void stageIF(int c) __attribute__((always_inline));
+static inline void stageID(void) __attribute__((always_inline));
+static inline void stageEX(int m, int n) __attribute__((always_inline));
+static inline void stageMEM(int c, int shared) __attribute__((always_inline));
+static inline void stageWB(void) __attribute__((always_inline));
+static inline long pipelineLoop(int m, int n, int c, long sim_cycle)
+        __attribute__((always_inline));
+static int writesReg(enum inst_op op);
+static void scoreboardAdvance(const struct inst *inst, enum stage from);
+static uint32_t srcMask(const struct inst *inst);
+static uint32_t dstMask(const struct inst *inst);
+static int16_t aluResult(enum inst_op op, int16_t rs, int16_t rt,
+        int16_t immediate);
+static long archExecute(const struct inst *inst, long pc);
+static inline int inProgram(long pc);
+static long loadWord(long addr);
+static void storeWord(long addr, long value);
+static void simErr(const char *function, int line, const char *msg, ...);
+
+// loop skipping helper functions
+static void loopKey(struct loop_key *key);
+static long loopIterations(long length);
+static void loopRefill(struct inst *latch, int progress);
+static void readOperands(struct inst *inst);
+
+// sampling helper functions
+static long fastForward(long count);
+static long detailedWindow(long warmup, long window, double *metrics);
+static void resetPipeline(void);
+static void printEstimate(FILE *output, const char *label,
+        const struct sample_stats *stats, int metric, double scale);
+
+// timeline helper functions
+static void timelineCounters(long *counters);
+static void timelineWrite(struct timeline *tl, const void *data, size_t len);
+static void timelineFlush(struct timeline *tl);
+static void putWord(uint8_t *bytes, uint32_t value);
+static void putLong(uint8_t *bytes, uint64_t value);
+
+// out-of-order helper functions
+static void oooCommit(void);
+static void oooExecute(void);
+static void oooIssue(void);
+static void oooDispatch(void);
+static int oooOperand(int reg, int16_t *value);
+static void oooBroadcast(int rob, int16_t value);
+static int16_t oooLoad(int rob, long addr);
+static enum unit unitOf(enum inst_op op);
+static int robAge(int rob);
+
+// multi-core helper functions
+static void *coreMain(void *arg);
+static int busGrant(long cycle);
+static void busArbitrate(long cycle);
+
+// instruction cache helper functions
+static long icacheFetch(long pc);
+static struct icache_line *icacheFill(long line, long ready);
+static long *icacheSlot(void);
+
+#ifdef SIM_HOOKS
+// observer hook helper functions
+static void runHooks(enum hook_point point, const struct inst *inst);
+#endif
+
+// profiler helper functions
+static void formatInst(char *buffer, size_t size, const struct im_inst *inst);
+static void keepSource(const char *line);
+
+// sweep engine helper functions
+static inline void blend(lane_t *dst, const lane_t *mask, const lane_t *src)
+        __attribute__((always_inline));
+static inline void addWide(wide_t *counter, lane_t *amount)
+        __attribute__((always_inline));
+static inline void laneCycle(struct lanes *restrict lanes,
+        const trace_t *restrict trace) __attribute__((always_inline));
+static inline void laneSkip(struct lanes *restrict lanes)
+        __attribute__((always_inline));
+static inline int anyLive(const lane_t *live) __attribute__((always_inline));
+static trace_t traceWord(const struct inst *inst);
+static void sweepOrder(const long *ops, const int *configs, int count,
+        int *order);
+static int parseSweep(char *list, int *configs, int max);
+
 // validation helper functions
 static void validate(const char *instruction, enum inst_op op,
         enum inst_type type);
@@ -150,63 +716,245 @@ static void validateLwSw(const char *instruction);
  * Instruction memory - 512 x 1-word instructions.
  * Word-addressable, so accesses would be something like IM[PC >> 2].
  */
-static struct inst IM[512];
+static struct im_inst IM[IM_SIZE];
+
+/**
+ * Number of instructions loaded into IM.
+ */
+static long IM_Length;
+
+/**
+ * Source line of each IM entry, 0 for machine code input.
+ */
+static long IM_Line[IM_SIZE];
+
+/**
+ * Line number of the last line progScanner read.
+ */
+static long Scanner_Line;
+
+/**
+ * Text of the lines progScanner read, kept for the profile listing when
+ * Keep_Source is set since piped input can't be read a second time.
+ */
+static char **Source_Lines;
+static long Source_Cap;
+static int Keep_Source;
+
+/**
+ * Assembly parsing - IM_Parsed entries of IM are complete and IM_Done is set
+ * at the end of the input, both guarded by IM_Mutex. While a producer thread
+ * streams the program in, IM_Length is only advanced by IF, up to IM_Parsed.
+ */
+static int IM_Streaming;
+static pthread_t IM_Producer;
+static pthread_mutex_t IM_Mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t IM_Cond = PTHREAD_COND_INITIALIZER;
+static long IM_Parsed;
+static int IM_Done;
+
+/**
+ * Report of the parse error that stopped the producer thread, for the main
+ * thread to print and exit with; NULL while there is none
+ */
+static char *IM_Error;
 
 /**
  * Data memory - 2kB.
  * Byte-addressable.
  */
-static uint8_t DM[2048];
+static uint8_t DM[DM_SIZE];
 
 /**
  * Program counter
  */
-static long PC;
+static PER_CORE long PC;
 
 /**
  * Latches
  */
-static struct inst IF_ID_latch, ID_EX_latch, EX_MEM_latch, MEM_WB_latch;
+static PER_CORE struct inst IF_ID_latch, ID_EX_latch, EX_MEM_latch,
+    MEM_WB_latch;
 
 /**
 * Flags
 */
-static int IF_ID_Flag, ID_EX_Flag, EX_MEM_Flag, MEM_WB_Flag, WB_HALT_Flag;
+static PER_CORE int IF_ID_Flag, ID_EX_Flag, EX_MEM_Flag, MEM_WB_Flag,
+    IF_HALT_Flag;
 
 /**
 * Registers
 */
-static long Registers[REG_NUM];
+static PER_CORE long Registers[REG_NUM];
 
 /**
 * Useful cycle counters
 */
-static long IF_WorkCycles, ID_WorkCycles, EX_WorkCycles, MEM_WorkCycles,
-    WB_WorkCycles;
+static PER_CORE long IF_WorkCycles, ID_WorkCycles, EX_WorkCycles,
+    MEM_WorkCycles, WB_WorkCycles;
+
+/**
+* IF, EX and MEM instruction cycle counters
+*/
+static PER_CORE long IF_Inst_Cycles, EX_Inst_Cycles, MEM_Inst_Cycles;
+
+/**
+* Cycles the instruction being fetched takes, when there's an instruction cache
+*/
+static PER_CORE long IF_Fetch_Latency;
+
+/**
+* Instruction cache, NULL for none
+*/
+static struct icache *ICache;
+
+/**
+* Instructions sent on by IF and retired by WB, halt excluded
+*/
+static PER_CORE long IF_Fetched, WB_Retired;
+
+/**
+* Stall cycles: ID waiting on a RAW hazard, IF frozen behind a branch, and a
+* stage holding a finished instruction because the next latch is full
+*/
+static PER_CORE long ID_RAWStalls, IF_BranchStalls, StructuralStalls;
+
+/**
+* Scoreboard - bit r of Pending_Writes is set from the time a write to
+* register r issues until it's written back, and Producer_Stage[r] is the
+* stage of the youngest such write
+*/
+static PER_CORE uint32_t Pending_Writes;
+static PER_CORE uint8_t Producer_Stage[REG_NUM];
+
+/**
+* Out-of-order back end - reorder buffer (a ring from ROB_Head), reservation
+* stations, register alias table (ROB index of the youngest pending write to
+* each register, -1 for none) and the reservation station each unit is
+* executing (-1 when idle)
+*/
+static struct rob_entry *ROB;
+static int ROB_Size, ROB_Head, ROB_Count;
+static struct rs_entry *RS;
+static int RS_Size, RS_Count;
+static int RAT[REG_NUM];
+static int Commit_Width;
+static int Unit_RS[UNIT_COUNT];
+static long Unit_Remaining[UNIT_COUNT];
+
+/**
+* Branches dispatched to the out-of-order back end but not yet resolved
+*/
+static int Unresolved_Branches;
+
+/**
+* Out-of-order statistics, occupancies are summed over every cycle
+*/
+static long OOO_RobOccupancy, OOO_RsOccupancy, OOO_UnitBusy[UNIT_COUNT],
+    OOO_RobFullStalls, OOO_RsFullStalls;
+
+/**
+* Profiler counters indexed like IM, NULL unless profiling
+*/
+static struct profile_entry *Profile;
+
+/**
+* Loop skipping - Skip_Loops enables it, EX raises Loop_Sync when it takes a
+* backward branch and WB records the IM index of every retired instruction in
+* the ring Retired_Path
+*/
+static int Skip_Loops;
+static PER_CORE int Loop_Sync;
+static int16_t Retired_Path[PATH_SIZE];
+
+/**
+* Timing state and counters at the previous backward branch
+*/
+static struct loop_key Loop_Last;
+static long Loop_Last_Cycle, Loop_Last_Counts[10];
+static int Loop_Have_Last;
+
+/**
+* Latencies: c cycles for memory access, m for multiply and n for all other EX
+* operations
+*/
+static int c, m, n;
+
+/**
+* Multi-core mode - the cores, the core this thread simulates and the core
+* the bus is granted to on its current cycle (-1 for none)
+*/
+static struct core *Cores;
+static int Core_Count;
+static PER_CORE int Core_Id;
+static PER_CORE int Bus_Owner;
+
+/**
+* Bus arbiter - the last cycle arbitrated, the core granted the bus on it
+* and the last core granted it round robin, guarded by Bus_Mutex
+*/
+static pthread_mutex_t Bus_Mutex = PTHREAD_MUTEX_INITIALIZER;
+static long Bus_Cycle;
+static int Bus_Granted, Bus_Last;
+
+/**
+* Cycles MEM waited for the bus
+*/
+static PER_CORE long BusStalls;
 
+#ifdef SIM_HOOKS
 /**
-* IF and EX instruction cycle counter
+* Observer hooks registered at each point, and the cycle they're told
 */
-static long IF_Inst_Cycles, EX_Inst_Cycles;
+static struct {
+    hook_fn fn;
+    void *data;
+} Hooks[HOOK_COUNT][MAX_HOOKS];
+static int Hook_Count[HOOK_COUNT];
+static PER_CORE long Hook_Cycle;
+#endif
+
+/**
+* How many times a core polls the clock of a core it waits for before
+* yielding - none when there are more cores than host CPUs, since the one it
+* waits for may not be running then
+*/
+static int Wait_Spins;
 
 // TODO - is this okay?
-static int haltPassedWB;
+static PER_CORE int haltPassedWB;
 
 /* ============================== Main Function ============================= */
 int main(int argc, char *argv[]) {
     // given variables
     int sim_mode = BATCH; // mode flag, 1 for single-cycle, 0 for batch
 
-    int c; // number of cycles for memory access
-    int m; // number of cycles for multiply
-    int n; // number of cycles for all other EX operations
-
     int i; // for loop counter
     long sim_cycle = 0; // simulation cycle counter
 
     FILE *input = NULL;
     FILE *output = NULL;
 
+    // m:n:c tuples for a sweep, the positional m n c always come first
+    int sweep[3 * 256];
+    int sweepCount = 0;
+
+    int format = FMT_ASM; // format of the input file
+
+    // sampling parameters, all in instructions; period 0 disables sampling
+    long samplePeriod = 0, sampleWindow = 0, sampleWarmup = 0;
+
+    struct timeline *timeline = NULL;
+
+    int oooMode = 0; // use the out-of-order back end
+
+    // where to write the profile, NULL for none
+    FILE *profileOut = NULL, *foldedOut = NULL;
+
+    int cores = 0; // cores of a multi-core run, 0 for a single pipeline
+
+    int stream = 0; // simulate while the program is still being parsed
+
     /* ========== Provided Startup Code ========== */
     printf("The arguments are:");
     for (i = 1; i < argc; i++) {
@@ -214,7 +962,7 @@ int main(int argc, char *argv[]) {
     }
     printf("\n");
 
-    if (argc == 7) {
+    if (argc >= 7) {
         if (strcmp("-s", argv[1]) == 0) {
             sim_mode = SINGLE;
         } else if (strcmp("-b", argv[1]) == 0) {
@@ -227,7 +975,8 @@ int main(int argc, char *argv[]) {
         m = atoi(argv[2]);
         n = atoi(argv[3]);
         c = atoi(argv[4]);
-        input = fopen(argv[5], "r");
+        // "-" reads the program from standard input, e.g. a pipe
+        input = strcmp(argv[5], "-") == 0 ? stdin : fopen(argv[5], "rb");
         output = fopen(argv[6], "w");
     } else {
         printf("Usage: ./sim-mips -s m n c input_name output_name "
@@ -235,8 +984,192 @@ int main(int argc, char *argv[]) {
                "output_name(batch mode)\n");
         printf("m,n,c stand for number of cycles needed by multiplication, "
                "other operation, and memory access, respectively\n");
+        printf("Options (after output_name):\n"
+               "  --sweep=m:n:c[,m:n:c...]  also simulate these latencies, "
+               "%d at a time in lockstep (batch mode only)\n"
+               "  --format=asm|raw|rawel|elf  input is assembly (default), "
+               "raw big/little endian MIPS32 words or an ELF file; ELF is "
+               "detected automatically\n"
+               "  --sample=period:window:warmup  fast-forward functionally and "
+               "simulate window instructions in detail, after warmup more, "
+               "every period instructions (batch mode only)\n"
+               "  --timeline=K:csv|bin:path  stream utilization, retired "
+               "instructions and stalls every K cycles to path\n"
+               "  --ooo=rs:rob:width  replace ID, EX, MEM and WB with an "
+               "out-of-order back end with rs reservation stations, a rob "
+               "entry reorder buffer and the given commit width\n"
+               "  --profile=path  write the program listing annotated with "
+               "cycles, stalls and execution counts per instruction\n"
+               "  --profile-folded=path  write the same profile as folded "
+               "stacks for flame graph tools\n"
+               "  --skip-loops  once a loop reaches a steady state, run its "
+               "remaining iterations functionally and extrapolate the cycle "
+               "counts (batch mode only, results are identical)\n"
+               "  --cores=N  simulate N pipelines sharing DM, one host thread "
+               "each; core k finds k in $k0 (batch mode only)\n"
+               "  --stream  start simulating while the assembly is still being "
+               "parsed, e.g. from a generator piped into input_name -\n"
+               "  --icache=size:ways:line:miss[:prefetch]  fetch through an "
+               "instruction cache of size bytes, prefetching the next "
+               "prefetch lines\n", LANES);
+        exit(0);
+    }
+    if (m < 1 || n < 1 || c < 1) {
+        printf("m, n and c must be at least 1\n");
+        exit(0);
+    }
+    sweep[0] = m;
+    sweep[1] = n;
+    sweep[2] = c;
+
+    for (i = 7; i < argc; i++) {
+        if (strncmp("--sweep=", argv[i], 8) == 0) {
+            sweepCount = parseSweep(argv[i] + 8, sweep + 3,
+                                    sizeof(sweep) / sizeof(*sweep) / 3 - 1);
+            if (sweepCount < 0) {
+                printf("Malformed sweep list: %s\n", argv[i] + 8);
+                exit(0);
+            }
+            ++sweepCount; // account for the positional m n c
+        } else if (strncmp("--sample=", argv[i], 9) == 0) {
+            if (sscanf(argv[i] + 9, "%ld:%ld:%ld", &samplePeriod,
+                       &sampleWindow, &sampleWarmup) != 3
+                || sampleWindow < 1 || sampleWarmup < 0
+                || samplePeriod < sampleWindow + sampleWarmup) {
+                printf("Malformed sample parameters: %s\n", argv[i] + 9);
+                exit(0);
+            }
+        } else if (strncmp("--timeline=", argv[i], 11) == 0) {
+            char *end;
+            long interval = strtol(argv[i] + 11, &end, 10);
+            int binary = strncmp(end, ":bin:", 5) == 0;
+            if (interval < 1 || (!binary && strncmp(end, ":csv:", 5) != 0)
+                || end[5] == '\0') {
+                printf("Malformed timeline parameters: %s\n", argv[i] + 11);
+                exit(0);
+            }
+            if (timeline) timelineClose(timeline, 0);
+            timeline = timelineOpen(end + 5, interval, binary);
+            if (timeline == NULL) {
+                printf("Cannot create timeline file %s\n", end + 5);
+                exit(0);
+            }
+        } else if (strncmp("--ooo=", argv[i], 6) == 0) {
+            int rsSize, robSize, width;
+            if (sscanf(argv[i] + 6, "%d:%d:%d", &rsSize, &robSize, &width) != 3
+                || rsSize < 1 || robSize < 1 || width < 1) {
+                printf("Malformed out-of-order parameters: %s\n", argv[i] + 6);
+                exit(0);
+            }
+            oooInit(rsSize, robSize, width);
+            oooMode = 1;
+        } else if (strncmp("--profile=", argv[i], 10) == 0) {
+            if ((profileOut = fopen(argv[i] + 10, "w")) == NULL) {
+                printf("Cannot create profile file %s\n", argv[i] + 10);
+                exit(0);
+            }
+            Keep_Source = 1;
+        } else if (strncmp("--profile-folded=", argv[i], 17) == 0) {
+            if ((foldedOut = fopen(argv[i] + 17, "w")) == NULL) {
+                printf("Cannot create profile file %s\n", argv[i] + 17);
+                exit(0);
+            }
+        } else if (strncmp("--cores=", argv[i], 8) == 0) {
+            char *end;
+            cores = (int) strtol(argv[i] + 8, &end, 10);
+            if (*end != '\0' || cores < 1 || cores > MAX_CORES) {
+                printf("Number of cores must be 1 to %d: %s\n", MAX_CORES,
+                       argv[i] + 8);
+                exit(0);
+            }
+        } else if (strncmp("--icache=", argv[i], 9) == 0) {
+            int size, ways, line, miss, prefetch = 0;
+            int fields = sscanf(argv[i] + 9, "%d:%d:%d:%d:%d", &size, &ways,
+                                &line, &miss, &prefetch);
+            if (fields < 4 || ways < 1 || line < 4 || line % 4 != 0
+                || size < ways * line || size % (ways * line) != 0
+                || miss < 1 || prefetch < 0) {
+                printf("Malformed instruction cache parameters: %s\n",
+                       argv[i] + 9);
+                exit(0);
+            }
+            icacheInit(size, ways, line, miss, prefetch);
+        } else if (strcmp("--stream", argv[i]) == 0) {
+            stream = 1;
+        } else if (strcmp("--skip-loops", argv[i]) == 0) {
+            Skip_Loops = 1;
+        } else if (strcmp("--format=asm", argv[i]) == 0) {
+            format = FMT_ASM;
+        } else if (strcmp("--format=raw", argv[i]) == 0) {
+            format = FMT_RAW;
+        } else if (strcmp("--format=rawel", argv[i]) == 0) {
+            format = FMT_RAWEL;
+        } else if (strcmp("--format=elf", argv[i]) == 0) {
+            format = FMT_ELF;
+        } else {
+            printf("Unknown option: %s\n", argv[i]);
+            exit(0);
+        }
+    }
+    if ((sweepCount || samplePeriod) && sim_mode == SINGLE) {
+        printf("--sweep and --sample are only available in batch mode\n");
+        exit(0);
+    }
+    if (sweepCount && samplePeriod) {
+        printf("--sweep and --sample can't be combined\n");
+        exit(0);
+    }
+    if (timeline && (sweepCount || samplePeriod)) {
+        printf("--timeline needs a full detailed run\n");
+        exit(0);
+    }
+    if (oooMode && (sweepCount || samplePeriod || timeline)) {
+        printf("--ooo can't be combined with --sweep, --sample or "
+               "--timeline\n");
+        exit(0);
+    }
+    if ((profileOut || foldedOut) && (sweepCount || samplePeriod || oooMode)) {
+        printf("--profile needs a full in-order run\n");
+        exit(0);
+    }
+    // skipped cycles never happen, so nothing that watches them can be on
+    if (Skip_Loops && (sim_mode == SINGLE || sweepCount || samplePeriod
+                       || timeline || oooMode || profileOut || foldedOut)) {
+        printf("--skip-loops needs a plain batch run\n");
+        exit(0);
+    }
+    if (cores && (sim_mode == SINGLE || sweepCount || samplePeriod || timeline
+                  || oooMode || profileOut || foldedOut || Skip_Loops)) {
+        printf("--cores needs a plain batch run\n");
+        exit(0);
+    }
+    // these need the whole program up front
+    if (stream && (format != FMT_ASM || sweepCount || samplePeriod
+                   || profileOut || foldedOut || Skip_Loops || cores)) {
+        printf("--stream needs assembly input and can't be combined with "
+               "--sweep, --sample, --profile, --skip-loops or --cores\n");
+        exit(0);
+    }
+#ifdef SIM_HOOKS
+    // hooksInit is handed the loaded program, which a stream doesn't have yet
+    if (stream) {
+        printf("--stream isn't available in a build with SIM_HOOKS\n");
+        exit(0);
+    }
+#endif
+    // the cache is one core's, and the sweep, sampling's fast-forward and
+    // loop skipping don't model it
+    if (ICache && (sweepCount || samplePeriod || Skip_Loops || cores)) {
+        printf("--icache can't be combined with --sweep, --sample, "
+               "--skip-loops or --cores\n");
+        exit(0);
+    }
+    if (input == stdin && sim_mode == SINGLE) {
+        printf("Single-cycle mode reads ENTER from standard input, so the "
+               "program can't come from there\n");
         exit(0);
     }
+
     if (input == NULL) {
         printf("Unable to open input or output file\n");
         exit(0);
@@ -247,19 +1180,206 @@ int main(int argc, char *argv[]) {
     }
 
     /* ========== IM Initialization ========== */
-    // TODO
+    // toolchain output is recognized by its ELF magic, if the input can be
+    // rewound after looking; a stream is taken as assembly
+    if (format == FMT_ASM && !stream && fseek(input, 0, SEEK_CUR) == 0) {
+        char magic[4];
+        if (fread(magic, 1, 4, input) == 4 && memcmp(magic, "\x7f" "ELF", 4) == 0) {
+            format = FMT_ELF;
+        }
+        rewind(input);
+    }
 
-    /* ========== Main Program Loop ========== */
-    while (1) {
-        // stop once halt has passed through every stage
-        if (haltPassedWB) break;
+    if (stream) {
+        streamProgram(input);
+    } else if (format == FMT_ASM) {
+        parseProgram(input);
+        IM_Length = IM_Parsed;
+    } else {
+        loadBinary(input, format);
+    }
+    if (profileOut || foldedOut) Profile = calloc(IM_Length, sizeof(*Profile));
+#ifdef SIM_HOOKS
+    hooksInit();
+#endif
+
+    /* ========== Lockstep Sweep ========== */
+    if (sweepCount) {
+        trace_t *trace = malloc((TRACE_CHUNK + 1) * sizeof(*trace));
+        long savedRegisters[REG_NUM];
+        uint8_t savedDM[DM_SIZE];
+        long savedPC = PC;
+        long ops[HALT + 1] = {0};
+        long traceLen = 0;
+        long len;
+
+        // a first pass for the final registers and the op counts; every
+        // group traces the program again from the start
+        memcpy(savedRegisters, Registers, sizeof(Registers));
+        memcpy(savedDM, DM, sizeof(DM));
+        do {
+            len = traceChunk(trace);
+            for (long t = 0; t < len; ++t) ops[TRACE_OP(trace[t])]++;
+            traceLen += len;
+        } while (TRACE_OP(trace[len]) != HALT);
+
+        fprintf(output, "program name: %s\n", argv[5]);
+        fprintf(output, "register values ");
+        for (i = 1; i < REG_NUM; i++) {
+            fprintf(output, "%ld  ", Registers[i]);
+        }
+        fprintf(output, "%ld\n", PC);
+
+        // every group of up to LANES configurations shares one pass over the
+        // trace, grouped by expected length but reported in the given order;
+        // a group takes as long as its slowest lane, so the group that isn't
+        // full is the one with the shortest configurations
+        int order[sizeof(sweep) / sizeof(*sweep) / 3];
+        int slot[sizeof(sweep) / sizeof(*sweep) / 3]; // inverse of order
+        int grouped[sizeof(sweep) / sizeof(*sweep)];
+        int groups = (sweepCount + LANES - 1) / LANES;
+        struct lanes *lanes = aligned_alloc(_Alignof(struct lanes),
+                                            groups * sizeof(*lanes));
+
+        sweepOrder(ops, sweep, sweepCount, order);
+        for (i = 0; i < sweepCount; ++i) {
+            memcpy(grouped + 3 * i, sweep + 3 * order[i], 3 * sizeof(int));
+            slot[order[i]] = i;
+        }
+        int first = sweepCount - (groups - 1) * LANES;
+        for (int g = 0; g < groups; ++g) {
+            memcpy(Registers, savedRegisters, sizeof(Registers));
+            memcpy(DM, savedDM, sizeof(DM));
+            PC = savedPC;
+            sweepLanes(&lanes[g], trace,
+                       grouped + 3 * (g ? first + (g - 1) * LANES : 0),
+                       g ? LANES : first);
+        }
+
+        for (int config = 0; config < sweepCount; ++config) {
+            int after = slot[config] - first; // place past the first group
+            struct lanes *group = &lanes[after < 0 ? 0 : 1 + after / LANES];
+            int l = after < 0 ? slot[config] : after % LANES;
+            double cycles = group->cycles[l];
+            fprintf(output, "m n c: %d %d %d stage utilization: "
+                    "%f  %f  %f  %f  %f total cycles: %ld\n",
+                    group->m[l], group->n[l], group->c[l],
+                    group->ifWork[l] / cycles, group->idWork[l] / cycles,
+                    group->exWork[l] / cycles, group->memWork[l] / cycles,
+                    group->wbWork[l] / cycles, (long) group->cycles[l]);
+        }
+        free(lanes);
+
+        printf("Program name: %s\n"
+               "Simulated %d configurations over %ld instructions\n",
+               argv[5], sweepCount, traceLen);
+        free(trace);
+        fclose(input);
+        fclose(output);
+        return 0;
+    }
+
+    /* ========== Sampled Simulation ========== */
+    if (samplePeriod) {
+        struct sample_stats stats = {0};
+        sampleProgram(samplePeriod, sampleWindow, sampleWarmup, &stats);
+
+        fprintf(output, "program name: %s\n", argv[5]);
+        fprintf(output, "sampled windows: %ld of %ld instructions each, "
+                "%ld instructions total\n", stats.windows, sampleWindow,
+                stats.instructions);
+        printEstimate(output, "CPI", &stats, 0, 1);
+        printEstimate(output, "total cycles", &stats, 0, stats.instructions);
+        printEstimate(output, "IF utilization", &stats, 1, 1);
+        printEstimate(output, "ID utilization", &stats, 2, 1);
+        printEstimate(output, "EX utilization", &stats, 3, 1);
+        printEstimate(output, "MEM utilization", &stats, 4, 1);
+        printEstimate(output, "WB utilization", &stats, 5, 1);
+
+        fprintf(output, "register values ");
+        for (i = 1; i < REG_NUM; i++) {
+            fprintf(output, "%ld  ", Registers[i]);
+        }
+        fprintf(output, "%ld\n", PC);
+
+        printf("Program name: %s\n"
+               "Sampled %ld windows over %ld instructions\n",
+               argv[5], stats.windows, stats.instructions);
+        fclose(input);
+        fclose(output);
+        return 0;
+    }
+
+    /* ========== Multi-Core Simulation ========== */
+    if (cores) {
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        runCores(cores);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        long cycles = 0, retired = 0, busStalls = 0, simulated = 0;
+        fprintf(output, "program name: %s\n", argv[5]);
+        for (int k = 0; k < cores; ++k) {
+            const struct core *core = &Cores[k];
+            double coreCycles = core->cycles;
+            fprintf(output, "core %d stage utilization: %f  %f  %f  %f  %f "
+                    "total cycles: %ld bus stalls: %ld\n", k,
+                    core->work[0] / coreCycles, core->work[1] / coreCycles,
+                    core->work[2] / coreCycles, core->work[3] / coreCycles,
+                    core->work[4] / coreCycles, core->cycles,
+                    core->busStalls);
+            fprintf(output, "core %d register values ", k);
+            for (i = 1; i < REG_NUM; i++) {
+                fprintf(output, "%ld  ", core->registers[i]);
+            }
+            fprintf(output, "%ld\n", core->PC);
+
+            if (core->cycles > cycles) cycles = core->cycles;
+            simulated += core->cycles;
+            retired += core->retired;
+            busStalls += core->busStalls;
+        }
+        fprintf(output, "cores: %d total cycles: %ld instructions: %ld "
+                "IPC: %f bus stalls: %ld\n", cores, cycles, retired,
+                (double) retired / cycles, busStalls);
+
+        // a core stops simulating once it has halted
+        double seconds = (end.tv_sec - start.tv_sec)
+                         + (end.tv_nsec - start.tv_nsec) / 1e9;
+        printf("Program name: %s\n"
+               "Cores: %d\n"
+               "Total CPU Cycles: %ld\n"
+               "Aggregate IPC: %f\n"
+               "Host throughput: %.0f core cycles per second\n",
+               argv[5], cores, cycles, (double) retired / cycles,
+               simulated / seconds);
+        free(Cores);
+        fclose(input);
+        fclose(output);
+        return 0;
+    }
+
+    /* ========== Main Program Loop ========== */
+    // plain batch runs take a loop compiled for their latencies if there is
+    // one, leaving nothing for the loop below
+    if (sim_mode == BATCH && !oooMode && !timeline) {
+        sim_cycle = runPipeline(sim_cycle);
+    }
+    while (1) {
+        // stop once halt has passed through every stage
+        if (haltPassedWB) break;
+        HOOK_CYCLE(sim_cycle);
 
         // call each stage in reverse
-        WB();
-        MEM();
-        EX();
-        ID();
-        IF();
+        if (oooMode) {
+            oooCycle();
+        } else {
+            WB();
+            MEM();
+            EX();
+            ID();
+            IF();
+        }
 
         /* ========== code fragment 2 ========== */
         if (sim_mode == SINGLE) {
@@ -273,6 +1393,22 @@ int main(int argc, char *argv[]) {
         }
 
         sim_cycle += 1;
+
+        if (Loop_Sync) loopSync(&sim_cycle);
+
+        if (timeline && sim_cycle % timeline->interval == 0) {
+            timelineRecord(timeline, sim_cycle);
+        }
+    }
+    if (stream) streamFinish(input);
+    if (timeline) timelineClose(timeline, sim_cycle);
+    if (profileOut) {
+        profileListing(profileOut, format, argv[5], sim_cycle);
+        fclose(profileOut);
+    }
+    if (foldedOut) {
+        profileFolded(foldedOut, argv[5]);
+        fclose(foldedOut);
     }
 
     // calculate utilization of each stage
@@ -282,11 +1418,33 @@ int main(int argc, char *argv[]) {
     double memUtil = (double) MEM_WorkCycles / sim_cycle;
     double wbUtil = (double) WB_WorkCycles / sim_cycle;
 
+    if (oooMode) {
+        if (sim_mode == BATCH) {
+            fprintf(output, "program name: %s\n", argv[5]);
+            oooReport(output, sim_cycle);
+            if (ICache) icacheReport(output);
+
+            fprintf(output, "register values ");
+            for (i = 1; i < REG_NUM; i++) {
+                fprintf(output, "%ld  ", Registers[i]);
+            }
+            fprintf(output, "%ld\n", PC);
+        }
+        printf("Program name: %s\n"
+               "IPC: %f\n"
+               "Total CPU Cycles: %ld\n",
+               argv[5], (double) WB_Retired / sim_cycle, sim_cycle);
+        fclose(input);
+        fclose(output);
+        return 0;
+    }
+
     /* ========== code fragment 3 ========== */
     if (sim_mode == BATCH) {
         fprintf(output, "program name: %s\n", argv[5]);
         fprintf(output, "stage utilization: %f  %f  %f  %f  %f \n",
                 ifUtil, idUtil, exUtil, memUtil, wbUtil);
+        if (ICache) icacheReport(output);
 
         fprintf(output, "register values ");
         for (i = 1; i < REG_NUM; i++) {
@@ -308,8 +1466,52 @@ int main(int argc, char *argv[]) {
 }
 
 /* ======================== Function Implementations ======================== */
-// TODO
-char *progScanner() {}
+char *progScanner(FILE *input) {
+    char line[256];
+
+    while (fgets(line, sizeof(line), input) != NULL) {
+        Scanner_Line++;
+        if (Keep_Source) keepSource(line);
+        char *buffer = malloc(strlen(line) + 1);
+        int bufferPointer = 0;
+        int openParen = 0;
+
+        for (char *cur = line; *cur; ++cur) {
+            // assert parentheses are balanced and not nested, as in 4($s0)
+            if (*cur == '(') {
+                if (openParen++) {
+                    PARSER_ERR("nested parenthesis", line, cur - line);
+                }
+            } else if (*cur == ')') {
+                if (!openParen--) {
+                    PARSER_ERR("unmatched parenthesis", line, cur - line);
+                }
+            }
+
+            // commas, parentheses and whitespace all separate tokens
+            if (*cur == ',' || *cur == '(' || *cur == ')' || isspace(*cur)) {
+                if (bufferPointer > 0 && buffer[bufferPointer - 1] != ' ') {
+                    buffer[bufferPointer++] = ' ';
+                }
+            } else {
+                buffer[bufferPointer++] = *cur;
+            }
+        }
+        if (openParen) {
+            PARSER_ERR("unmatched parenthesis", line, 0);
+        }
+
+        // if there's a trailing space, remove it; terminate the string regardless
+        if (bufferPointer > 0 && buffer[bufferPointer - 1] == ' ') --bufferPointer;
+        buffer[bufferPointer] = '\0';
+
+        // skip blank lines
+        if (bufferPointer > 0) return buffer;
+        free(buffer);
+    }
+
+    return NULL;
+}
 
 char *regNumberConverter(char *instruction) {
     // local copies of data to prevent modification of external data
@@ -330,7 +1532,7 @@ char *regNumberConverter(char *instruction) {
             char *regNum = getRegNumber(curToken, base, instruction);
             // add the result into the buffer
             len = strlen(regNum);
-            strncpy(buffer + bufferPointer, regNum, len);
+            memcpy(buffer + bufferPointer, regNum, len);
             bufferPointer += len;
             buffer[bufferPointer++] = ' ';
             // we don't need regNum anymore
@@ -342,7 +1544,7 @@ char *regNumberConverter(char *instruction) {
                 PARSER_ERR("invalid instruction", copy, 0);
             }
             // copy the token into buffer and add the space afterwards
-            strncpy(buffer + bufferPointer, curToken, len);
+            memcpy(buffer + bufferPointer, curToken, len);
             bufferPointer += len;
             buffer[bufferPointer++] = ' ';
         }
@@ -357,7 +1559,7 @@ char *regNumberConverter(char *instruction) {
 }
 
 struct inst parser(char *instruction) {
-    struct inst inst;
+    struct inst inst = {0};
     char *converted = regNumberConverter(instruction);
 
     // set the op
@@ -374,6 +1576,8 @@ struct inst parser(char *instruction) {
         parseRType(&inst, converted, strchr(converted, ' ') + 1);
     } else if (inst.type == I_TYPE) {
         parseIType(&inst, converted, strchr(converted, ' ') + 1);
+        // loads write rt, keep it in rd so WB and hazard checks needn't care
+        if (inst.op == LW) inst.rd = (uint8_t) inst.rt;
     } else {
         // halt instruction, no further processing needed
         free(converted);
@@ -384,100 +1588,500 @@ struct inst parser(char *instruction) {
     return inst;
 }
 
-// TODO
+void streamProgram(FILE *input) {
+    IM_Streaming = 1;
+    if (pthread_create(&IM_Producer, NULL, parseProgram, input) != 0) {
+        SIM_ERR("cannot start the parser thread");
+    }
+}
+
+void streamFinish(FILE *input) {
+    struct stat info;
+
+    if (fstat(fileno(input), &info) != 0 || !S_ISREG(info.st_mode)) {
+        pthread_cancel(IM_Producer);
+    }
+    pthread_join(IM_Producer, NULL);
+    IM_Streaming = 0;
+    IM_Length = IM_Parsed;
+    imCheck();
+}
+
+void loadBinary(FILE *input, int format) {
+    // slurp the file, it's at most a few kB of code
+    long size = 0, cap = 4096;
+    uint8_t *bytes = malloc(cap);
+    size_t got;
+    while ((got = fread(bytes + size, 1, cap - size, input)) > 0) {
+        size += got;
+        if (size == cap) bytes = realloc(bytes, cap *= 2);
+    }
+
+    const uint8_t *text = bytes;
+    long textSize = size;
+    int bigEndian = format != FMT_RAWEL;
+
+    if (format == FMT_ELF) {
+        // ELF32 header: class, byte order and machine, then the section table
+        if (size < 52 || memcmp(bytes, "\x7f" "ELF", 4) != 0 || bytes[4] != 1) {
+            SIM_ERR("not a 32-bit ELF file");
+        }
+        bigEndian = bytes[5] == 2;
+        if (readHalf(bytes + 18, bigEndian) != 8) {
+            SIM_ERR("ELF file isn't for MIPS");
+        }
+        uint32_t shoff = readWord(bytes + 32, bigEndian);
+        uint16_t shentsize = readHalf(bytes + 46, bigEndian);
+        uint16_t shnum = readHalf(bytes + 48, bigEndian);
+        uint16_t shstrndx = readHalf(bytes + 50, bigEndian);
+        // every entry must hold at least the 40 bytes of an Elf32_Shdr
+        if (shentsize < 40 || shstrndx >= shnum
+            || (long) shoff + (long) shnum * shentsize > size) {
+            SIM_ERR("malformed ELF section table");
+        }
+        const uint8_t *strTab = bytes + shoff + shstrndx * shentsize;
+        uint32_t strOff = readWord(strTab + 16, bigEndian);
+        uint32_t strSize = readWord(strTab + 20, bigEndian);
+        if ((long) strOff + strSize > size) {
+            SIM_ERR("malformed ELF section name table");
+        }
+
+        // find .text by name
+        text = NULL;
+        for (int i = 0; i < shnum; ++i) {
+            const uint8_t *sh = bytes + shoff + i * shentsize;
+            uint32_t name = readWord(sh, bigEndian);
+            uint32_t off = readWord(sh + 16, bigEndian);
+            uint32_t len = readWord(sh + 20, bigEndian);
+            // names are offsets into the name table, which must hold all of
+            // ".text" and its terminator
+            if (strSize >= 6 && name <= strSize - 6
+                && memcmp(bytes + strOff + name, ".text", 6) == 0) {
+                if (off + (long) len > size) SIM_ERR("truncated .text section");
+                text = bytes + off;
+                textSize = len;
+                break;
+            }
+        }
+        if (text == NULL) SIM_ERR("ELF file has no .text section");
+    }
+
+    if (textSize % 4 != 0) {
+        SIM_ERR("code size %ld isn't a whole number of words", textSize);
+    }
+    if (textSize / 4 > IM_SIZE) {
+        SIM_ERR("program doesn't fit in %d instructions", IM_SIZE);
+    }
+    for (long i = 0; i < textSize / 4; ++i) {
+        IM[IM_Length++] = decodeWord(readWord(text + 4 * i, bigEndian), i);
+    }
+
+    free(bytes);
+}
+
 void IF(void) {
-	
-    IF_Inst_Cycles++;
-	struct inst curr_inst;
-	curr_inst= IM[PC];                                            // create local copy of the instruction to be executed
-
-	if (IF_ID_Flag==0){                                           // check if latch is empty
-		if (curr_inst.op==HALT){                  
-	    	IF_ID_latch= curr_inst;                               // send the halt instruction to the next stage
-			IF_ID_Flag=1;
-		}
-		if (IF_Inst_Cycles>=c){                
-			IF_ID_latch= curr_inst;                               // send the instruction to the next stage
-			PC= PC + 4;                                           // change PC to the next instruction
-			IF_ID_Flag=1;                                         // set flag IF/ID latch not empty
-			IF_Inst_Cycles=0;
-			IF_WorkCycles=IF_WorkCycles+c;                        // updates count of useful cycles
-		}
-	}
-}
-
-// TODO
-void ID(void) {}
-
-// TODO
+    stageIF(c);
+}
+
+void ID(void) {
+    stageID();
+}
+
 void EX(void) {
- 
- 	if(ID_EX_Flag==1 && EX_Inst_Cycles==0){
- 		struct curr_inst= ID_EX_latch;
- 		ID_EX_Flag=0;
- 	}
- 
- 	EX_Inst_Cycles++;
-
-        //ADD operation
-	if (curr_inst.op==ADD){
-		if (EX_Inst_Cycles>=n){
-			curr_inst.EX_result= (int16_t) curr_inst.rs + curr_inst.rt;
-		}
-	}
-	
-	//ADDI operation
-	if (curr_inst.op==ADDI){
-		if (EX_Inst_Cycles>=n){
-			curr_inst.EX_result= (int16_t) curr_inst.rs + curr_inst.immediate;
-		}
-	}
-	
-	//BEQ operation
-	if (curr_inst.op==BEQ){
-		if (EX_Inst_Cycles>=n){
-			curr_inst.EX_result= (int16_t) curr_inst.rt - curr_inst.rs;
-			if (curr_inst.EX_result==0) PC = PC + 4 + 4 * (curr_inst.immediate);
-		}
-	}
-	
-	//LW and SW operation, not sure how to do this
-	if (curr_inst.op==LW || curr_inst..op==SW){
-		if (EX_Inst_Cycles>=n){
-			curr_inst.EX_result= (int16_t) curr_inst.rs + curr_inst.immediate; 
-		}
-	}
-	
-	//SUB operation
-	if (curr_inst.op==SUB){
-		if (EX_Inst_Cycles>=n){
-			curr_inst.EX_result= (int16_t) curr_inst.rs - curr_inst.rt;
-		}
-	}
-	
-	//MUL operation
-	if (curr_inst.op==MUL){
-		if (EX_Inst_Cycles>=m){
-			curr_inst.EX_result= (int16_t) curr_inst.rs * curr_inst.rt;
-		}
-	}
-	
-	//send instruction to MEM
-	if (EX_MEM_Flag==0){
-		EX_MEM_latch=curr.inst;
-		EX_MEM_Flag=1;
-		EX_Inst_Cycles=0;
-		if (curr_inst.op==MUL) EX_WorkCycles=EX_WorkCycles+m;
-		else if (curr_inst.op!=HALT && curr_inst.op!=MUL) EX_WorkCycles=EX_WorkCycles+n;
-	}
-		
-}
-
-// TODO
-void MEM(void) {}
-
-// TODO
-void WB(void) {}
+    stageEX(m, n);
+}
+
+void MEM(void) {
+    stageMEM(c, 0);
+}
+
+void WB(void) {
+    stageWB();
+}
+
+long traceChunk(trace_t *chunk) {
+    long len = 0;
+
+    while (len < TRACE_CHUNK) {
+        if (!inProgram(PC)) {
+            SIM_ERR("PC is outside the program: %ld", PC);
+        }
+        struct inst inst = unpackInst(&IM[PC >> 2]);
+        chunk[len++] = traceWord(&inst);
+
+        // halt doesn't advance PC in the pipeline either, and lanes past it
+        // read the entry after without using it
+        if (inst.op == HALT) {
+            chunk[len] = HALT;
+            return len;
+        }
+        PC = archExecute(&inst, PC);
+    }
+    chunk[len] = TRACE_WAIT;
+    return len;
+}
+
+struct timeline *timelineOpen(const char *path, long interval, int binary) {
+    FILE *file = fopen(path, binary ? "wb" : "w");
+    if (file == NULL) return NULL;
+
+    struct timeline *tl = calloc(1, sizeof(*tl));
+    tl->file = file;
+    tl->binary = binary;
+    tl->interval = interval;
+
+    if (binary) {
+        uint8_t header[16] = "MIPSTL2";
+        putLong(header + 8, (uint64_t) interval);
+        timelineWrite(tl, header, sizeof(header));
+    } else {
+        const char *header = "cycle,if_util,id_util,ex_util,mem_util,wb_util,"
+                             "retired,raw_stalls,branch_stalls,"
+                             "structural_stalls\n";
+        timelineWrite(tl, header, strlen(header));
+    }
+    return tl;
+}
+
+void timelineRecord(struct timeline *tl, long sim_cycle) {
+    long now[9], delta[9];
+    long cycles = sim_cycle - tl->lastCycle;
+
+    timelineCounters(now);
+    for (int i = 0; i < 9; ++i) {
+        delta[i] = now[i] - tl->last[i];
+        tl->last[i] = now[i];
+    }
+    tl->lastCycle = sim_cycle;
+
+    if (tl->binary) {
+        uint8_t record[88];
+        putLong(record, (uint64_t) sim_cycle);
+        for (int i = 0; i < 9; ++i) {
+            putLong(record + 8 + 8 * i, (uint64_t) delta[i]);
+        }
+        putLong(record + 80, (uint64_t) cycles);
+        timelineWrite(tl, record, sizeof(record));
+    } else {
+        char line[256];
+        int len = snprintf(line, sizeof(line),
+                "%ld,%f,%f,%f,%f,%f,%ld,%ld,%ld,%ld\n", sim_cycle,
+                (double) delta[0] / cycles, (double) delta[1] / cycles,
+                (double) delta[2] / cycles, (double) delta[3] / cycles,
+                (double) delta[4] / cycles, delta[5], delta[6], delta[7],
+                delta[8]);
+        timelineWrite(tl, line, len);
+    }
+}
+
+void timelineClose(struct timeline *tl, long sim_cycle) {
+    if (sim_cycle > tl->lastCycle) timelineRecord(tl, sim_cycle);
+    timelineFlush(tl);
+    fclose(tl->file);
+    free(tl);
+}
+
+void oooInit(int rsSize, int robSize, int width) {
+    // a repeated --ooo replaces the earlier sizes
+    free(ROB);
+    free(RS);
+
+    ROB = calloc(robSize, sizeof(*ROB));
+    ROB_Size = robSize;
+    RS = calloc(rsSize, sizeof(*RS));
+    RS_Size = rsSize;
+    Commit_Width = width;
+
+    for (int i = 0; i < REG_NUM; ++i) RAT[i] = -1;
+    for (int u = 0; u < UNIT_COUNT; ++u) Unit_RS[u] = -1;
+}
+
+void oooCycle(void) {
+    oooCommit();
+    oooExecute();
+    oooIssue();
+    oooDispatch();
+    IF();
+
+    OOO_RobOccupancy += ROB_Count;
+    OOO_RsOccupancy += RS_Count;
+}
+
+void oooReport(FILE *output, long sim_cycle) {
+    double cycles = sim_cycle;
+
+    fprintf(output, "IPC: %f (%ld instructions in %ld cycles)\n",
+            WB_Retired / cycles, WB_Retired, sim_cycle);
+    fprintf(output, "average ROB occupancy: %f of %d\n",
+            OOO_RobOccupancy / cycles, ROB_Size);
+    fprintf(output, "average RS occupancy: %f of %d\n",
+            OOO_RsOccupancy / cycles, RS_Size);
+    fprintf(output, "unit utilization (alu mul ls): %f  %f  %f\n",
+            OOO_UnitBusy[UNIT_ALU] / cycles, OOO_UnitBusy[UNIT_MUL] / cycles,
+            OOO_UnitBusy[UNIT_LS] / cycles);
+    fprintf(output, "dispatch stalls: ROB full %ld RS full %ld\n",
+            OOO_RobFullStalls, OOO_RsFullStalls);
+}
+
+void profileListing(FILE *listing, int format, const char *program,
+        long sim_cycle) {
+    char line[256];
+    long lineNumber = 0, index = 0;
+
+    fprintf(listing, "# program: %s  total cycles: %ld\n", program, sim_cycle);
+    fprintf(listing, "# %9s %9s %9s %9s %9s %9s %9s %9s %9s  source\n",
+            "execs", "IF", "ID", "EX", "MEM", "WB", "raw", "branch",
+            "struct");
+
+    while (1) {
+        const char *source;
+        if (format == FMT_ASM) {
+            if (lineNumber == Scanner_Line) break;
+            source = Source_Lines[lineNumber++];
+        } else {
+            // machine code has no text to annotate, so list it disassembled
+            if (index == IM_Length) break;
+            formatInst(line, sizeof(line), &IM[index]);
+            source = line;
+            lineNumber = 0;
+        }
+
+        if (index < IM_Length && IM_Line[index] == lineNumber) {
+            const struct profile_entry *p = &Profile[index++];
+            fprintf(listing, "  %9ld %9ld %9ld %9ld %9ld %9ld %9ld %9ld %9ld  "
+                    "%s\n", p->executions, p->cycles[0], p->cycles[1],
+                    p->cycles[2], p->cycles[3], p->cycles[4], p->rawStalls,
+                    p->branchStalls, p->structuralStalls, source);
+        } else {
+            fprintf(listing, "  %89s  %s\n", "", source);
+        }
+    }
+}
+
+void profileFolded(FILE *folded, const char *program) {
+    static const char *stages[] = {"IF", "ID", "EX", "MEM", "WB"};
+    char text[64];
+
+    for (long i = 0; i < IM_Length; ++i) {
+        const struct profile_entry *p = &Profile[i];
+        formatInst(text, sizeof(text), &IM[i]);
+
+        for (int s = 0; s < 5; ++s) {
+            if (p->cycles[s] == 0) continue;
+            fprintf(folded, "%s;%ld %s;%s %ld\n", program, i, text, stages[s],
+                    p->cycles[s]);
+        }
+        if (p->rawStalls) {
+            fprintf(folded, "%s;%ld %s;raw stall %ld\n", program, i, text,
+                    p->rawStalls);
+        }
+        if (p->branchStalls) {
+            fprintf(folded, "%s;%ld %s;branch stall %ld\n", program, i, text,
+                    p->branchStalls);
+        }
+        if (p->structuralStalls) {
+            fprintf(folded, "%s;%ld %s;structural stall %ld\n", program, i,
+                    text, p->structuralStalls);
+        }
+    }
+}
+
+void loopSync(long *sim_cycle) {
+    // counters advanced when loop iterations are skipped
+    long *const counters[10] = {
+        &IF_WorkCycles, &ID_WorkCycles, &EX_WorkCycles, &MEM_WorkCycles,
+        &WB_WorkCycles, &WB_Retired, &IF_Fetched, &ID_RAWStalls,
+        &IF_BranchStalls, &StructuralStalls
+    };
+    struct loop_key key;
+    Loop_Sync = 0;
+    loopKey(&key);
+
+    if (Loop_Have_Last && memcmp(&key, &Loop_Last, sizeof(key)) == 0) {
+        long length = WB_Retired - Loop_Last_Counts[5];
+        long iterations = length > 0 && length <= PATH_SIZE
+                          ? loopIterations(length) : 0;
+
+        if (iterations > 0) {
+            long delta[10];
+            for (int i = 0; i < 10; ++i) {
+                delta[i] = *counters[i] - Loop_Last_Counts[i];
+            }
+            long cycleDelta = *sim_cycle - Loop_Last_Cycle;
+
+            // run the skipped instructions, starting with the oldest one in
+            // flight since everything older has already written back; a store
+            // that already did MEM just writes the same word again
+            long pc = 4L * Retired_Path[(WB_Retired - length) % PATH_SIZE];
+            for (long i = 0; i < iterations * length; ++i) {
+                struct inst inst = unpackInst(&IM[pc >> 2]);
+                pc = archExecute(&inst, pc);
+            }
+
+            // the same instructions are in flight, iterations later, so only
+            // the values they've picked up need refreshing
+            if (MEM_WB_Flag) loopRefill(&MEM_WB_latch, 2);
+            if (EX_MEM_Flag) loopRefill(&EX_MEM_latch, 1);
+            if (ID_EX_Flag) {
+                long latency = ID_EX_latch.op == MUL ? m : n;
+                loopRefill(&ID_EX_latch, EX_Inst_Cycles >= latency);
+            }
+
+            // the path ring must read as if the skipped instructions retired
+            int16_t last[PATH_SIZE];
+            for (long i = 0; i < length; ++i) {
+                last[i] = Retired_Path[(WB_Retired - length + i) % PATH_SIZE];
+            }
+            for (long i = 0; i < length; ++i) {
+                long to = WB_Retired + (iterations - 1) * length + i;
+                Retired_Path[to % PATH_SIZE] = last[i];
+            }
+            for (int i = 0; i < 10; ++i) {
+                *counters[i] += iterations * delta[i];
+            }
+            *sim_cycle += iterations * cycleDelta;
+        }
+    }
+
+    Loop_Last = key;
+    Loop_Last_Cycle = *sim_cycle;
+    for (int i = 0; i < 10; ++i) Loop_Last_Counts[i] = *counters[i];
+    Loop_Have_Last = 1;
+}
+
+void sampleProgram(long period, long window, long warmup,
+        struct sample_stats *stats) {
+    double metrics[6];
+
+    while (1) {
+        // architectural state only up to the next detailed window
+        long skipped = fastForward(period - window - warmup);
+        stats->instructions += skipped;
+        if (!inProgram(PC)) SIM_ERR("PC is outside the program: %ld", PC);
+        if (unpackInst(&IM[PC >> 2]).op == HALT) return;
+
+        long measured = detailedWindow(warmup, window, metrics);
+        stats->instructions += WB_Retired;
+        if (measured > 0) {
+            stats->windows++;
+            for (int i = 0; i < 6; ++i) {
+                stats->sum[i] += metrics[i];
+                stats->sumSq[i] += metrics[i] * metrics[i];
+            }
+        }
+        if (haltPassedWB) return;
+    }
+}
+
+void runCores(int count) {
+    Cores = aligned_alloc(_Alignof(struct core), count * sizeof(*Cores));
+    memset(Cores, 0, count * sizeof(*Cores));
+    Core_Count = count;
+    Bus_Cycle = -1;
+    Bus_Last = count - 1; // so core 0 is granted first
+    Wait_Spins = count <= sysconf(_SC_NPROCESSORS_ONLN) ? WAIT_SPINS : 0;
+
+    for (int k = 0; k < count; ++k) {
+        if (pthread_create(&Cores[k].thread, NULL, coreMain, &Cores[k]) != 0) {
+            SIM_ERR("cannot start a thread for core %d", k);
+        }
+    }
+    for (int k = 0; k < count; ++k) pthread_join(Cores[k].thread, NULL);
+}
+
+#ifdef SIM_HOOKS
+void addHook(enum hook_point point, hook_fn fn, void *data) {
+    if (Hook_Count[point] == MAX_HOOKS) {
+        SIM_ERR("more than %d hooks at point %d", MAX_HOOKS, point);
+    }
+    Hooks[point][Hook_Count[point]].fn = fn;
+    Hooks[point][Hook_Count[point]++].data = data;
+}
+#endif
+
+long runPipeline(long sim_cycle) {
+    // one instance of the loop per tuple, with the latencies as constants
+#define INSTANCE(M, N, C) \
+    if (m == M && n == N && c == C) return pipelineLoop(M, N, C, sim_cycle);
+    SPECIALIZED_LATENCIES(INSTANCE)
+#undef INSTANCE
+
+    return pipelineLoop(m, n, c, sim_cycle);
+}
+
+void icacheInit(int size, int ways, int lineSize, int missLatency,
+        int prefetch) {
+    free(ICache ? ICache->lines : NULL);
+    free(ICache);
+
+    ICache = calloc(1, sizeof(*ICache));
+    ICache->sets = size / (ways * lineSize);
+    ICache->ways = ways;
+    ICache->lineSize = lineSize;
+    ICache->missLatency = missLatency;
+    ICache->prefetch = prefetch;
+    ICache->lines = malloc((size_t) ICache->sets * ways
+                           * sizeof(*ICache->lines));
+    for (long i = 0; i < (long) ICache->sets * ways; ++i) {
+        ICache->lines[i].tag = -1;
+    }
+}
+
+void icacheReport(FILE *output) {
+    long fetches = ICache->hits + ICache->misses;
+
+    fprintf(output, "icache hits: %ld misses: %ld hit rate: %f "
+            "prefetches: %ld useful: %ld late: %ld\n", ICache->hits,
+            ICache->misses, fetches ? (double) ICache->hits / fetches : 0.0,
+            ICache->prefetches, ICache->usefulPrefetches,
+            ICache->latePrefetches);
+}
+
+SWEEP_TARGETS
+void sweepLanes(struct lanes *lanes, trace_t *trace,
+        const int *configs, int count) {
+    int most = 1;
+    memset(lanes, 0, sizeof(*lanes));
+    traceChunk(trace);
+
+    for (int l = 0; l < LANES; ++l) {
+        // idle lanes copy the first configuration but never run
+        const int *config = configs + 3 * (l < count ? l : 0);
+        lanes->m[l] = config[0];
+        lanes->n[l] = config[1];
+        lanes->c[l] = config[2];
+        lanes->live[l] = l < count ? -1 : 0;
+        lanes->ifNext[l] = (int32_t) trace[0];
+        for (int i = 0; i < 3; ++i) if (config[i] > most) most = config[i];
+    }
+
+    // a skip and the cycle after it add at most the longest latency to a
+    // count, so the 32-bit counts can go this many steps between flushes; a
+    // lane that has halted is left alone, so steps past the last halt change
+    // nothing
+    long block = INT32_MAX / most < 256 ? INT32_MAX / most : 256;
+    do {
+        for (long i = 0; i < block; ++i) {
+            laneSkip(lanes);
+            laneCycle(lanes, trace);
+        }
+        addWide(&lanes->ifWork, &lanes->ifAcc);
+        addWide(&lanes->idWork, &lanes->idAcc);
+        addWide(&lanes->exWork, &lanes->exAcc);
+        addWide(&lanes->memWork, &lanes->memAcc);
+        addWide(&lanes->wbWork, &lanes->wbAcc);
+        addWide(&lanes->cycles, &lanes->cycleAcc);
+
+        // lanes stop where the chunk ends, and once they all have they go on
+        // with the next one from its start
+        lane_t running = lanes->live & (TRACE_OP(lanes->ifNext) != TRACE_WAIT);
+        if (anyLive(&lanes->live) && !anyLive(&running)) {
+            traceChunk(trace);
+            lanes->ifIdx = (lane_t) {0};
+            lanes->ifNext = (lane_t) {0} + (int32_t) trace[0];
+        }
+    } while (anyLive(&lanes->live));
+}
 
 /* ==================== Helper Function Implementations ===================== */
 // converts a string of a register name to a register token
@@ -585,9 +2189,9 @@ static char *getRegNumber(char *token, char *base, char *original) {
                 PARSER_ERR("invalid register number: %s", original,
                         token - base, token);
         }
-
-        return result;
     }
+
+    return result;
 }
 
 // determines the op of the given instruction
@@ -719,7 +2323,7 @@ static void parseAddi(struct inst *inst, char *converted,
             remainingTokens - converted);
     ++remainingTokens;
 
-    if (!isdigit(*remainingTokens) || *remainingTokens == '-') {
+    if (!isdigit(*remainingTokens) && *remainingTokens != '-') {
         PARSER_ERR("expected a digit for the immediate, found: %s", converted,
                    remainingTokens - converted, remainingTokens);
     }
@@ -746,7 +2350,7 @@ static void parseBeq(struct inst *inst, char *converted,
             remainingTokens - converted);
     ++remainingTokens;
 
-    if (!isdigit(*remainingTokens) || *remainingTokens == '-') {
+    if (!isdigit(*remainingTokens) && *remainingTokens != '-') {
         PARSER_ERR("expected a digit for the immediate, found: %s", converted,
                    remainingTokens - converted, remainingTokens);
     }
@@ -812,17 +2416,35 @@ static void parserErr(const char *function, int line, const char *msg,
     va_list args;
     va_start(args, col);
 
-    fprintf(stderr, "[ERROR - %s#%d] ", function, line);
-    vfprintf(stderr, msg, args);
-    fprintf(stderr, "\n%s\n", inst);
+    // a streamed program is only parsed on the producer thread, which hands
+    // the report to the main thread and stops rather than exiting under it
+    char *report = NULL;
+    size_t size;
+    FILE *out = stderr;
+    if (IM_Streaming) {
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+        out = open_memstream(&report, &size);
+    }
+
+    fprintf(out, "[ERROR - %s#%d] ", function, line);
+    vfprintf(out, msg, args);
+    fprintf(out, "\n%s\n", inst);
 
     if (col > 0) {
-        for (int i = 0; i < col; ++i) fprintf(stderr, " ");
-        fprintf(stderr, "^\n");
+        for (int i = 0; i < col; ++i) fprintf(out, " ");
+        fprintf(out, "^\n");
     }
 
     va_end(args);
-    exit(EXIT_FAILURE);
+    if (!IM_Streaming) exit(EXIT_FAILURE);
+
+    fclose(out);
+    pthread_mutex_lock(&IM_Mutex);
+    IM_Error = report;
+    IM_Done = 1;
+    pthread_cond_broadcast(&IM_Cond);
+    pthread_mutex_unlock(&IM_Mutex);
+    pthread_exit(NULL);
 }
 
 // delegates to an appropriate validation method, which exits if instruction is invalid
@@ -918,7 +2540,9 @@ static void validateAddiBeq(const char *instruction) {
                    instruction, 0);
     }
 
-    if (!isdigit(*(cur + 1))) {
+    // the immediate/offset may be negative, e.g. for backward branches
+    if (!isdigit(*(cur + 1))
+        && !(*(cur + 1) == '-' && isdigit(*(cur + 2)))) {
         PARSER_ERR("malformed number for the immediate/offset", instruction,
                    cur + 1 - instruction);
     }
@@ -976,3 +2600,1417 @@ static void validateLwSw(const char *instruction) {
                    instruction, cur - instruction, cur);
     }
 }
+
+// parses the assembly in input into IM, publishing each instruction as it's
+// stored; the body of the producer thread when the program is streamed
+static void *parseProgram(void *input) {
+    char *line;
+
+    while ((line = progScanner(input)) != NULL) {
+        if (IM_Parsed == IM_SIZE) {
+            PARSER_ERR("program doesn't fit in %d instructions", line, 0,
+                       IM_SIZE);
+        }
+        struct inst inst = parser(line);
+        IM_Line[IM_Parsed] = Scanner_Line;
+        IM[IM_Parsed] = packInst(&inst);
+        free(line);
+
+        pthread_mutex_lock(&IM_Mutex);
+        IM_Parsed++;
+        pthread_cond_broadcast(&IM_Cond);
+        pthread_mutex_unlock(&IM_Mutex);
+    }
+
+    pthread_mutex_lock(&IM_Mutex);
+    IM_Done = 1;
+    pthread_cond_broadcast(&IM_Cond);
+    pthread_mutex_unlock(&IM_Mutex);
+    return NULL;
+}
+
+// waits for IM entry index while the program is streamed in, taking in
+// everything parsed so far; returns whether the entry exists
+static int imWait(long index) {
+    if (!IM_Streaming) return 0;
+
+    pthread_mutex_lock(&IM_Mutex);
+    while (index >= IM_Parsed && !IM_Done) {
+        pthread_cond_wait(&IM_Cond, &IM_Mutex);
+    }
+    IM_Length = IM_Parsed;
+    pthread_mutex_unlock(&IM_Mutex);
+
+    if (index >= IM_Length) imCheck();
+    return index < IM_Length;
+}
+
+// prints the parse error the producer thread stopped at, if any, and exits;
+// only the main thread may exit, the producer could be cut off mid-report
+static void imCheck(void) {
+    pthread_mutex_lock(&IM_Mutex);
+    char *error = IM_Error;
+    pthread_mutex_unlock(&IM_Mutex);
+
+    if (error == NULL) return;
+    if (IM_Streaming) pthread_join(IM_Producer, NULL);
+    fputs(error, stderr);
+    exit(EXIT_FAILURE);
+}
+
+// packs a parsed instruction for storage in IM
+static struct im_inst packInst(const struct inst *inst) {
+    struct im_inst packed = {
+        .op = (uint8_t) inst->op,
+        .type = (uint8_t) inst->type,
+        .rs = (uint8_t) inst->rs,
+        .rt = (uint8_t) inst->rt,
+        .rd = inst->rd,
+        .immediate = inst->immediate
+    };
+    return packed;
+}
+
+// expands an IM entry into the form carried through the latches
+static struct inst unpackInst(const struct im_inst *inst) {
+    struct inst unpacked = {
+        .op = (enum inst_op) inst->op,
+        .type = (enum inst_type) inst->type,
+        .rs = inst->rs,
+        .rt = inst->rt,
+        .rd = inst->rd,
+        .immediate = inst->immediate
+    };
+    return unpacked;
+}
+
+// decodes a single MIPS32 word, exiting on anything the pipeline can't run
+static struct im_inst decodeWord(uint32_t word, long index) {
+    struct inst inst = {0};
+    uint32_t opcode = word >> 26;
+    uint32_t funct = word & 0x3f;
+    uint8_t rs = (word >> 21) & 0x1f;
+    uint8_t rt = (word >> 16) & 0x1f;
+    uint8_t rd = (word >> 11) & 0x1f;
+    int16_t immediate = (int16_t) (word & 0xffff);
+
+    if (word == 0) {
+        // nop (sll $0, $0, 0) - an add that writes $zero does nothing
+        inst.op = ADD;
+    } else if (opcode == 0x00 && (funct == 0x20 || funct == 0x21)) {
+        inst.op = ADD; // add, addu
+    } else if (opcode == 0x00 && (funct == 0x22 || funct == 0x23)) {
+        inst.op = SUB; // sub, subu
+    } else if (opcode == 0x1c && funct == 0x02) {
+        inst.op = MUL;
+    } else if (opcode == 0x00 && funct == 0x0d) {
+        inst.op = HALT; // break
+    } else if (opcode == 0x08 || opcode == 0x09) {
+        inst.op = ADDI; // addi, addiu
+    } else if (opcode == 0x04) {
+        inst.op = BEQ;
+    } else if (opcode == 0x23) {
+        inst.op = LW;
+    } else if (opcode == 0x2b) {
+        inst.op = SW;
+    } else {
+        SIM_ERR("unsupported instruction 0x%08x at word %ld", word, index);
+    }
+    inst.type = getInstType(inst.op);
+
+    switch (inst.op) {
+        case ADD:
+        case SUB:
+        case MUL:
+            inst.rd = rd;
+            inst.rs = rs;
+            inst.rt = rt;
+            break;
+        case ADDI:
+            // rt is the destination of an I-type
+            inst.rd = rt;
+            inst.rs = rs;
+            inst.immediate = immediate;
+            break;
+        case LW:
+        case SW:
+            if (immediate & 0x3) {
+                SIM_ERR("misaligned memory access 0x%08x at word %ld", word,
+                        index);
+            }
+            inst.rd = inst.op == LW ? rt : 0;
+            // fall through
+        case BEQ:
+            inst.rs = rs;
+            inst.rt = rt;
+            inst.immediate = immediate;
+            break;
+        default:
+            break;
+    }
+
+    return packInst(&inst);
+}
+
+// reads a 32-bit word in the given byte order
+static uint32_t readWord(const uint8_t *bytes, int bigEndian) {
+    if (bigEndian) {
+        return (uint32_t) bytes[0] << 24 | (uint32_t) bytes[1] << 16
+               | (uint32_t) bytes[2] << 8 | bytes[3];
+    }
+    return (uint32_t) bytes[3] << 24 | (uint32_t) bytes[2] << 16
+           | (uint32_t) bytes[1] << 8 | bytes[0];
+}
+
+// reads a 16-bit half word in the given byte order
+static uint16_t readHalf(const uint8_t *bytes, int bigEndian) {
+    return bigEndian ? (uint16_t) (bytes[0] << 8 | bytes[1])
+                     : (uint16_t) (bytes[1] << 8 | bytes[0]);
+}
+
+// the stages as inline bodies so the loop of each instance is straight-line
+// code; latencies are parameters that shadow the globals, so an instance
+// passing constants gets them folded in
+static inline void stageIF(int c) {
+    if (ICache) ICache->now++;
+    // nothing left to fetch once halt has been sent down the pipeline
+    if (IF_HALT_Flag) return;
+    // freeze until a branch in ID or EX is resolved
+    if ((IF_ID_Flag && IF_ID_latch.op == BEQ)
+        || (ID_EX_Flag && ID_EX_latch.op == BEQ) || Unresolved_Branches) {
+        IF_BranchStalls++;
+        PROFILE(IF_ID_Flag && IF_ID_latch.op == BEQ ? IF_ID_latch.index
+                : ID_EX_latch.index, branchStalls);
+        return;
+    }
+
+    // a streamed program may not have reached PC yet
+    if (!inProgram(PC) && (PC < 0 || !imWait(PC >> 2))) {
+        SIM_ERR("PC is outside the program: %ld", PC);
+    }
+    struct inst curr_inst = unpackInst(&IM[PC >> 2]); // local copy of the instruction to be fetched
+    curr_inst.index = (int16_t) (PC >> 2);
+    PROFILE(curr_inst.index, cycles[0]);
+
+    if (curr_inst.op == HALT) {
+        if (IF_ID_Flag == 0) {
+            IF_ID_latch = curr_inst; // send the halt instruction to the next stage
+            IF_ID_Flag = 1;
+            IF_HALT_Flag = 1;
+            HOOK(HOOK_FETCH, &IF_ID_latch);
+        }
+        return;
+    }
+
+    // the instruction cache decides how long a fetch takes, as it starts
+    if (ICache && IF_Inst_Cycles == 0) IF_Fetch_Latency = icacheFetch(PC);
+    long latency = ICache ? IF_Fetch_Latency : c;
+
+    if (IF_Inst_Cycles < latency) IF_Inst_Cycles++;
+    // check if latch is empty
+    if (IF_Inst_Cycles >= latency && IF_ID_Flag == 0) {
+        IF_ID_latch = curr_inst; // send the instruction to the next stage
+        PC = PC + 4; // change PC to the next instruction
+        IF_ID_Flag = 1; // set flag IF/ID latch not empty
+        IF_Inst_Cycles = 0;
+        IF_Fetched++;
+        // updates count of useful cycles
+        IF_WorkCycles = IF_WorkCycles + latency;
+        HOOK(HOOK_FETCH, &IF_ID_latch);
+    } else if (IF_Inst_Cycles >= latency) {
+        StructuralStalls++;
+        PROFILE(curr_inst.index, structuralStalls);
+    }
+}
+
+static inline void stageID(void) {
+    if (IF_ID_Flag == 0) return;
+    PROFILE(IF_ID_latch.index, cycles[1]);
+    if (ID_EX_Flag == 1) {
+        StructuralStalls++;
+        PROFILE(IF_ID_latch.index, structuralStalls);
+        return;
+    }
+
+    struct inst curr_inst = IF_ID_latch;
+
+    if (curr_inst.op != HALT) {
+        // stall on RAW hazards until the producer has written back
+        if (srcMask(&curr_inst) & Pending_Writes) {
+            ID_RAWStalls++;
+            PROFILE(curr_inst.index, rawStalls);
+            return;
+        }
+
+        readOperands(&curr_inst);
+        ID_WorkCycles++;
+    }
+    HOOK(HOOK_DECODE, &curr_inst);
+
+    // issue: claim the destination on the scoreboard
+    uint32_t dst = dstMask(&curr_inst);
+    if (dst) {
+        Pending_Writes |= dst;
+        Producer_Stage[curr_inst.rd] = STAGE_EX;
+    }
+
+    ID_EX_latch = curr_inst;
+    ID_EX_Flag = 1;
+    IF_ID_Flag = 0;
+    HOOK(HOOK_ISSUE, &ID_EX_latch);
+}
+
+static inline void stageEX(int m, int n) {
+    if (ID_EX_Flag == 0) return;
+
+    // work on the latch in place so ID can see what's in flight
+    struct inst *curr_inst = &ID_EX_latch;
+    PROFILE(curr_inst->index, cycles[2]);
+    long latency = curr_inst->op == HALT ? 0 : curr_inst->op == MUL ? m : n;
+
+    if (EX_Inst_Cycles < latency) {
+        EX_Inst_Cycles++;
+        if (EX_Inst_Cycles == latency) {
+            curr_inst->EX_result = aluResult(curr_inst->op, curr_inst->rs,
+                    curr_inst->rt, curr_inst->immediate);
+            HOOK(HOOK_EXECUTE, curr_inst);
+            // resolve branches as soon as they're computed so IF can resume;
+            // PC already points past the branch since IF froze behind it
+            if (curr_inst->op == BEQ) {
+                if (curr_inst->EX_result == 0) {
+                    PC = PC + 4 * curr_inst->immediate;
+                    if (curr_inst->immediate < 0) Loop_Sync = Skip_Loops;
+                }
+                curr_inst->op = DEADBEQ;
+            }
+        }
+    }
+
+    //send instruction to MEM
+    if (EX_Inst_Cycles >= latency && EX_MEM_Flag == 0) {
+        scoreboardAdvance(curr_inst, STAGE_EX);
+        EX_MEM_latch = *curr_inst;
+        EX_MEM_Flag = 1;
+        ID_EX_Flag = 0;
+        EX_Inst_Cycles = 0;
+        EX_WorkCycles = EX_WorkCycles + latency;
+    } else if (EX_Inst_Cycles >= latency) {
+        StructuralStalls++;
+        PROFILE(curr_inst->index, structuralStalls);
+    }
+}
+
+// shared is a constant at every call site, so only the multi-core loop pays
+// for the bus check
+static inline void stageMEM(int c, int shared) {
+    if (EX_MEM_Flag == 0) return;
+
+    struct inst *curr_inst = &EX_MEM_latch;
+    PROFILE(curr_inst->index, cycles[3]);
+    int isMemOp = curr_inst->op == LW || curr_inst->op == SW;
+
+    if (isMemOp && MEM_Inst_Cycles < c) {
+        // another core holds the bus
+        if (shared && Bus_Owner != Core_Id) {
+            BusStalls++;
+            return;
+        }
+        MEM_Inst_Cycles++;
+    }
+    if ((!isMemOp || MEM_Inst_Cycles >= c) && MEM_WB_Flag == 0) {
+        if (isMemOp) HOOK(HOOK_MEMORY, curr_inst);
+        if (curr_inst->op == LW) {
+            curr_inst->EX_result = (int16_t) loadWord(curr_inst->EX_result);
+        } else if (curr_inst->op == SW) {
+            storeWord(curr_inst->EX_result, curr_inst->rt);
+        }
+        if (isMemOp) MEM_WorkCycles = MEM_WorkCycles + c;
+
+        scoreboardAdvance(curr_inst, STAGE_MEM);
+        MEM_WB_latch = *curr_inst;
+        MEM_WB_Flag = 1;
+        EX_MEM_Flag = 0;
+        MEM_Inst_Cycles = 0;
+    }
+}
+
+static inline void stageWB(void) {
+    if (MEM_WB_Flag == 0) return;
+    PROFILE(MEM_WB_latch.index, cycles[4]);
+
+    if (MEM_WB_latch.op == HALT) {
+        haltPassedWB = 1;
+    } else {
+        if (writesReg(MEM_WB_latch.op)) {
+            // $zero is hardwired
+            if (MEM_WB_latch.rd != 0) {
+                Registers[MEM_WB_latch.rd] = MEM_WB_latch.EX_result;
+            }
+            scoreboardAdvance(&MEM_WB_latch, STAGE_WB);
+            WB_WorkCycles++;
+        }
+        if (Skip_Loops) {
+            Retired_Path[WB_Retired % PATH_SIZE] = MEM_WB_latch.index;
+        }
+        WB_Retired++;
+        PROFILE(MEM_WB_latch.index, executions);
+        HOOK(HOOK_WRITEBACK, &MEM_WB_latch);
+    }
+    MEM_WB_Flag = 0;
+}
+
+// the batch simulation loop of main, for runPipeline to instantiate
+static inline long pipelineLoop(int m, int n, int c, long sim_cycle) {
+    while (!haltPassedWB) {
+        HOOK_CYCLE(sim_cycle);
+        stageWB();
+        stageMEM(c, 0);
+        stageEX(m, n);
+        stageID();
+        stageIF(c);
+        sim_cycle += 1;
+        if (Loop_Sync) loopSync(&sim_cycle);
+    }
+    return sim_cycle;
+}
+
+// whether the op writes its rd back to the register file
+static int writesReg(enum inst_op op) {
+    return op == ADD || op == ADDI || op == SUB || op == MUL || op == LW;
+}
+
+// follows an instruction's pending write out of stage from; a younger write
+// to the same register has already retagged it, so only the youngest moves the
+// tag, and leaving WB releases the register
+static void scoreboardAdvance(const struct inst *inst, enum stage from) {
+    if (!dstMask(inst) || Producer_Stage[inst->rd] != from) return;
+
+    if (from == STAGE_WB) {
+        Pending_Writes &= ~(1u << inst->rd);
+        Producer_Stage[inst->rd] = STAGE_NONE;
+    } else {
+        Producer_Stage[inst->rd] = from + 1;
+    }
+}
+
+// bit mask of the registers an undecoded instruction reads, excluding $zero
+static uint32_t srcMask(const struct inst *inst) {
+    uint32_t mask;
+    switch (inst->op) {
+        case ADD:
+        case SUB:
+        case MUL:
+        case BEQ:
+        case SW:
+            mask = (1u << inst->rs) | (1u << inst->rt);
+            break;
+        case ADDI:
+        case LW:
+            mask = 1u << inst->rs;
+            break;
+        default:
+            mask = 0;
+    }
+    return mask & ~1u;
+}
+
+// bit mask of the register an instruction writes, 0 if none
+static uint32_t dstMask(const struct inst *inst) {
+    if (!writesReg(inst->op)) return 0;
+    return (1u << inst->rd) & ~1u;
+}
+
+// computes the EX result of an instruction from its operand values
+static int16_t aluResult(enum inst_op op, int16_t rs, int16_t rt,
+        int16_t immediate) {
+    switch (op) {
+        case ADD:
+            return (int16_t) (rs + rt);
+        case ADDI:
+        case LW:
+        case SW:
+            return (int16_t) (rs + immediate);
+        case SUB:
+            return (int16_t) (rs - rt);
+        case MUL:
+            return (int16_t) (rs * rt);
+        case BEQ:
+            return (int16_t) (rt - rs);
+        default:
+            return 0;
+    }
+}
+
+// executes an instruction directly on Registers and DM, returning the next PC
+static long archExecute(const struct inst *inst, long pc) {
+    int16_t rs = (int16_t) Registers[inst->rs];
+    int16_t rt = (int16_t) Registers[inst->rt];
+    int16_t result = aluResult(inst->op, rs, rt, inst->immediate);
+
+    switch (inst->op) {
+        case BEQ:
+            return result == 0 ? pc + 4 + 4 * inst->immediate : pc + 4;
+        case LW:
+            result = (int16_t) loadWord(result);
+            break;
+        case SW:
+            storeWord(result, rt);
+            break;
+        default:
+            break;
+    }
+
+    if (writesReg(inst->op) && inst->rd != 0) Registers[inst->rd] = result;
+    return pc + 4;
+}
+
+// whether pc addresses a loaded instruction; branches can send it below 0
+static inline int inProgram(long pc) {
+    return pc >= 0 && (pc >> 2) < IM_Length;
+}
+
+// reads a little-endian word from DM, exiting on a bad address
+static long loadWord(long addr) {
+    if (addr < 0 || addr > DM_SIZE - 4 || (addr & 0x3)) {
+        SIM_ERR("invalid data memory address: %ld", addr);
+    }
+    return (int32_t) ((uint32_t) DM[addr] | (uint32_t) DM[addr + 1] << 8
+                      | (uint32_t) DM[addr + 2] << 16
+                      | (uint32_t) DM[addr + 3] << 24);
+}
+
+// writes a little-endian word to DM, exiting on a bad address
+static void storeWord(long addr, long value) {
+    if (addr < 0 || addr > DM_SIZE - 4 || (addr & 0x3)) {
+        SIM_ERR("invalid data memory address: %ld", addr);
+    }
+    DM[addr] = (uint8_t) value;
+    DM[addr + 1] = (uint8_t) (value >> 8);
+    DM[addr + 2] = (uint8_t) (value >> 16);
+    DM[addr + 3] = (uint8_t) (value >> 24);
+}
+
+// Logs a runtime error and exits the program
+static void simErr(const char *function, int line, const char *msg, ...) {
+    va_list args;
+    va_start(args, msg);
+
+    fprintf(stderr, "[ERROR - %s#%d] ", function, line);
+    vfprintf(stderr, msg, args);
+    fprintf(stderr, "\n");
+
+    va_end(args);
+    exit(EXIT_FAILURE);
+}
+
+// captures the timing state of the pipeline
+static void loopKey(struct loop_key *key) {
+    const struct inst *latches[4] = {&IF_ID_latch, &ID_EX_latch,
+                                     &EX_MEM_latch, &MEM_WB_latch};
+    const int occupied[4] = {IF_ID_Flag, ID_EX_Flag, EX_MEM_Flag, MEM_WB_Flag};
+
+    // zeroed so padding doesn't break memcmp
+    memset(key, 0, sizeof(*key));
+    key->PC = PC;
+    key->ifCycles = IF_Inst_Cycles;
+    key->exCycles = EX_Inst_Cycles;
+    key->memCycles = MEM_Inst_Cycles;
+    for (int i = 0; i < 4; ++i) {
+        key->flags[i] = occupied[i];
+        if (occupied[i]) {
+            key->index[i] = latches[i]->index;
+            key->op[i] = (uint8_t) latches[i]->op;
+        }
+    }
+    key->flags[4] = IF_HALT_Flag;
+    key->flags[5] = haltPassedWB;
+    key->pending = Pending_Writes;
+    memcpy(key->producer, Producer_Stage, sizeof(key->producer));
+}
+
+// counts how many whole iterations of length instructions can be skipped:
+// the instructions retired over the last iteration must repeat for all of
+// them plus everything that will be in flight afterwards, including the one
+// IF is working on; checked on the real state, which is restored afterwards
+static long loopIterations(long length) {
+    static long savedRegisters[REG_NUM];
+    static uint8_t savedDM[DM_SIZE];
+    long start = WB_Retired - length;
+    long inFlight = IF_Fetched - WB_Retired + 1;
+    long matched = 0;
+
+    if (IF_HALT_Flag) return 0;
+    memcpy(savedRegisters, Registers, sizeof(Registers));
+    memcpy(savedDM, DM, sizeof(DM));
+
+    // equal keys put the same instruction in the oldest slot of the pipeline
+    // as an iteration ago, which is the first one retired since
+    long pc = 4L * Retired_Path[start % PATH_SIZE];
+    while (inProgram(pc)
+           && (pc >> 2) == Retired_Path[(start + matched % length) % PATH_SIZE]) {
+        struct inst inst = unpackInst(&IM[pc >> 2]);
+        if (inst.op == HALT) break;
+        pc = archExecute(&inst, pc);
+        ++matched;
+    }
+
+    memcpy(Registers, savedRegisters, sizeof(Registers));
+    memcpy(DM, savedDM, sizeof(DM));
+    return matched < inFlight ? 0 : (matched - inFlight) / length;
+}
+
+// recomputes the values an in-flight instruction carries from the current
+// architectural state: operands always, the EX result when progress is at
+// least 1 and the memory access when it's 2
+static void loopRefill(struct inst *latch, int progress) {
+    struct inst inst = unpackInst(&IM[latch->index]);
+
+    readOperands(&inst);
+    if (progress >= 1) {
+        inst.EX_result = aluResult(inst.op, inst.rs, inst.rt, inst.immediate);
+    }
+    if (progress >= 2) {
+        if (inst.op == LW) {
+            inst.EX_result = (int16_t) loadWord(inst.EX_result);
+        } else if (inst.op == SW) {
+            storeWord(inst.EX_result, inst.rt);
+        }
+    }
+
+    // resolved branches keep their state
+    inst.op = latch->op;
+    inst.index = latch->index;
+    *latch = inst;
+}
+
+// replaces the register indices an instruction reads with their contents
+static void readOperands(struct inst *inst) {
+    switch (inst->op) {
+        case ADD:
+        case SUB:
+        case MUL:
+        case BEQ:
+        case SW:
+            inst->rt = (int16_t) Registers[inst->rt];
+            // fall through
+        case ADDI:
+        case LW:
+            inst->rs = (int16_t) Registers[inst->rs];
+            break;
+        default:
+            break;
+    }
+}
+
+// executes up to count instructions on the architectural state, stopping at
+// halt, and returns how many ran
+static long fastForward(long count) {
+    long executed = 0;
+
+    while (executed < count) {
+        if (!inProgram(PC)) {
+            SIM_ERR("PC is outside the program: %ld", PC);
+        }
+        struct inst inst = unpackInst(&IM[PC >> 2]);
+        if (inst.op == HALT) break;
+        PC = archExecute(&inst, PC);
+        ++executed;
+    }
+
+    return executed;
+}
+
+// runs the pipeline from an empty state for warmup + window instructions and
+// drains it; fills metrics with the CPI and stage utilization of the window
+// instructions and returns how many of them retired before any halt
+static long detailedWindow(long warmup, long window, double *metrics) {
+    long startCycle = -1, cycle = 0;
+    long startWork[5] = {0};
+
+    resetPipeline();
+    while (!haltPassedWB) {
+        // the measured span starts once the warm-up instructions retire
+        if (WB_Retired == warmup && startCycle < 0) {
+            startCycle = cycle;
+            startWork[0] = IF_WorkCycles;
+            startWork[1] = ID_WorkCycles;
+            startWork[2] = EX_WorkCycles;
+            startWork[3] = MEM_WorkCycles;
+            startWork[4] = WB_WorkCycles;
+        }
+        if (WB_Retired == warmup + window) break;
+
+        // stop fetching once the window is in flight
+        if (IF_Fetched == warmup + window) IF_HALT_Flag = 1;
+
+        HOOK_CYCLE(cycle);
+        WB();
+        MEM();
+        EX();
+        ID();
+        IF();
+        cycle++;
+    }
+    long measured = WB_Retired - warmup;
+
+    // drain the rest without measuring so PC and the registers are precise
+    while (!haltPassedWB
+           && (IF_ID_Flag || ID_EX_Flag || EX_MEM_Flag || MEM_WB_Flag)) {
+        WB();
+        MEM();
+        EX();
+        ID();
+        IF();
+    }
+
+    if (measured <= 0 || cycle == startCycle) return 0;
+
+    double cycles = cycle - startCycle;
+    metrics[0] = cycles / measured;
+    metrics[1] = (IF_WorkCycles - startWork[0]) / cycles;
+    metrics[2] = (ID_WorkCycles - startWork[1]) / cycles;
+    metrics[3] = (EX_WorkCycles - startWork[2]) / cycles;
+    metrics[4] = (MEM_WorkCycles - startWork[3]) / cycles;
+    metrics[5] = (WB_WorkCycles - startWork[4]) / cycles;
+    return measured;
+}
+
+// empties the latches and clears every counter, keeping PC and the
+// architectural state
+static void resetPipeline(void) {
+    IF_ID_Flag = ID_EX_Flag = EX_MEM_Flag = MEM_WB_Flag = 0;
+    IF_HALT_Flag = haltPassedWB = 0;
+    IF_Inst_Cycles = EX_Inst_Cycles = MEM_Inst_Cycles = 0;
+    IF_WorkCycles = ID_WorkCycles = EX_WorkCycles = MEM_WorkCycles = 0;
+    WB_WorkCycles = 0;
+    IF_Fetched = WB_Retired = 0;
+    Pending_Writes = 0;
+    memset(Producer_Stage, STAGE_NONE, sizeof(Producer_Stage));
+}
+
+// prints the mean of a sampled metric times scale with its 95% confidence
+// interval
+static void printEstimate(FILE *output, const char *label,
+        const struct sample_stats *stats, int metric, double scale) {
+    long k = stats->windows;
+    if (k == 0) {
+        fprintf(output, "%s: no samples\n", label);
+        return;
+    }
+
+    double mean = stats->sum[metric] / k;
+    if (k < 2) {
+        fprintf(output, "%s: %f (too few samples for an interval)\n", label,
+                mean * scale);
+        return;
+    }
+    double variance = (stats->sumSq[metric] - k * mean * mean) / (k - 1);
+    if (variance < 0) variance = 0; // rounding
+    fprintf(output, "%s: %f +/- %f\n", label, mean * scale,
+            1.96 * sqrt(variance / k) * scale);
+}
+
+// snapshots the counters a timeline record is built from; the stages credit
+// their work when an instruction leaves, so the cycles already spent on the
+// one they hold are added to charge every cycle to the interval it ran in
+static void timelineCounters(long *counters) {
+    counters[0] = IF_WorkCycles + IF_Inst_Cycles;
+    counters[1] = ID_WorkCycles;
+    counters[2] = EX_WorkCycles + EX_Inst_Cycles;
+    counters[3] = MEM_WorkCycles + MEM_Inst_Cycles;
+    counters[4] = WB_WorkCycles;
+    counters[5] = WB_Retired;
+    counters[6] = ID_RAWStalls;
+    counters[7] = IF_BranchStalls;
+    counters[8] = StructuralStalls;
+}
+
+// appends data to the timeline buffer, writing it out first if it's full
+static void timelineWrite(struct timeline *tl, const void *data, size_t len) {
+    if (tl->used + len > sizeof(tl->buffer)) timelineFlush(tl);
+    memcpy(tl->buffer + tl->used, data, len);
+    tl->used += len;
+}
+
+// writes out whatever is buffered
+static void timelineFlush(struct timeline *tl) {
+    if (tl->used && fwrite(tl->buffer, 1, tl->used, tl->file) != tl->used) {
+        SIM_ERR("couldn't write the timeline: %s", strerror(errno));
+    }
+    tl->used = 0;
+}
+
+// stores a little-endian 32-bit word
+static void putWord(uint8_t *bytes, uint32_t value) {
+    bytes[0] = (uint8_t) value;
+    bytes[1] = (uint8_t) (value >> 8);
+    bytes[2] = (uint8_t) (value >> 16);
+    bytes[3] = (uint8_t) (value >> 24);
+}
+
+// stores a little-endian 64-bit word
+static void putLong(uint8_t *bytes, uint64_t value) {
+    putWord(bytes, (uint32_t) value);
+    putWord(bytes + 4, (uint32_t) (value >> 32));
+}
+
+// retires up to Commit_Width finished instructions from the head of the ROB
+static void oooCommit(void) {
+    for (int i = 0; i < Commit_Width && ROB_Count > 0; ++i) {
+        struct rob_entry *entry = &ROB[ROB_Head];
+        if (!entry->done) return;
+
+        if (entry->inst.op == HALT) {
+            haltPassedWB = 1;
+            return;
+        }
+        if (writesReg(entry->inst.op) && entry->inst.rd != 0) {
+            Registers[entry->inst.rd] = entry->inst.EX_result;
+            // a younger write may have renamed the register since
+            if (RAT[entry->inst.rd] == ROB_Head) RAT[entry->inst.rd] = -1;
+        } else if (entry->inst.op == SW) {
+            HOOK(HOOK_MEMORY, &entry->inst);
+            storeWord(entry->inst.EX_result, entry->inst.rt);
+        }
+
+        WB_Retired++;
+        HOOK(HOOK_WRITEBACK, &entry->inst);
+        ROB_Head = (ROB_Head + 1) % ROB_Size;
+        ROB_Count--;
+    }
+}
+
+// counts down each busy unit and broadcasts the results that finish
+static void oooExecute(void) {
+    for (int u = 0; u < UNIT_COUNT; ++u) {
+        if (Unit_RS[u] < 0) continue;
+        OOO_UnitBusy[u]++;
+        if (--Unit_Remaining[u] > 0) continue;
+
+        int rob = RS[Unit_RS[u]].rob;
+        struct inst *inst = &ROB[rob].inst;
+        inst->EX_result = aluResult(inst->op, inst->rs, inst->rt,
+                inst->immediate);
+        HOOK(HOOK_EXECUTE, inst);
+        if (inst->op == LW) {
+            HOOK(HOOK_MEMORY, inst);
+            inst->EX_result = oooLoad(rob, inst->EX_result);
+        } else if (inst->op == BEQ) {
+            // PC already points past the branch since IF froze behind it
+            if (inst->EX_result == 0) PC = PC + 4 * inst->immediate;
+            inst->op = DEADBEQ;
+            Unresolved_Branches--;
+        }
+        ROB[rob].done = 1;
+        if (writesReg(inst->op)) oooBroadcast(rob, inst->EX_result);
+
+        RS[Unit_RS[u]].busy = 0;
+        RS_Count--;
+        Unit_RS[u] = -1;
+    }
+}
+
+// starts the oldest ready reservation station on each idle unit
+static void oooIssue(void) {
+    for (enum unit u = 0; u < UNIT_COUNT; ++u) {
+        if (Unit_RS[u] >= 0) continue;
+
+        int oldest = -1;
+        for (int i = 0; i < RS_Size; ++i) {
+            struct rs_entry *rs = &RS[i];
+            if (!rs->busy || rs->issued || rs->qj >= 0 || rs->qk >= 0
+                || unitOf(ROB[rs->rob].inst.op) != u) continue;
+            if (oldest >= 0 && robAge(rs->rob) > robAge(RS[oldest].rob)) continue;
+
+            // loads wait until every older store knows its address
+            if (ROB[rs->rob].inst.op == LW) {
+                int blocked = 0;
+                for (int r = ROB_Head; r != rs->rob; r = (r + 1) % ROB_Size) {
+                    if (ROB[r].inst.op == SW && !ROB[r].done) blocked = 1;
+                }
+                if (blocked) continue;
+            }
+            oldest = i;
+        }
+        if (oldest < 0) continue;
+
+        enum inst_op op = ROB[RS[oldest].rob].inst.op;
+        RS[oldest].issued = 1;
+        Unit_RS[u] = oldest;
+        HOOK(HOOK_ISSUE, &ROB[RS[oldest].rob].inst);
+        Unit_Remaining[u] = op == MUL ? m : op == LW ? n + c : n;
+    }
+}
+
+// renames the instruction in IF/ID into a ROB entry and reservation station
+static void oooDispatch(void) {
+    if (IF_ID_Flag == 0) return;
+    if (ROB_Count == ROB_Size) {
+        OOO_RobFullStalls++;
+        return;
+    }
+
+    struct inst inst = IF_ID_latch;
+    int tail = (ROB_Head + ROB_Count) % ROB_Size;
+
+    if (inst.op != HALT) {
+        int slot = -1;
+        for (int i = 0; i < RS_Size && slot < 0; ++i) {
+            if (!RS[i].busy) slot = i;
+        }
+        if (slot < 0) {
+            OOO_RsFullStalls++;
+            return;
+        }
+
+        struct rs_entry *rs = &RS[slot];
+        rs->busy = 1;
+        rs->issued = 0;
+        rs->rob = tail;
+        rs->qj = oooOperand(inst.rs, &inst.rs);
+        rs->qk = -1;
+        if (inst.type == R_TYPE || inst.op == BEQ || inst.op == SW) {
+            rs->qk = oooOperand(inst.rt, &inst.rt);
+        }
+        RS_Count++;
+
+        if (inst.op == BEQ) Unresolved_Branches++;
+        ID_WorkCycles++;
+    }
+
+    HOOK(HOOK_DECODE, &inst);
+    ROB[tail].inst = inst;
+    ROB[tail].done = inst.op == HALT;
+    if (dstMask(&inst)) RAT[inst.rd] = tail;
+    ROB_Count++;
+    IF_ID_Flag = 0;
+}
+
+// reads a source register through the RAT, returning the ROB index to wait
+// on or -1 with value filled in
+static int oooOperand(int reg, int16_t *value) {
+    int rob = RAT[reg];
+
+    if (rob < 0) {
+        *value = (int16_t) Registers[reg];
+        return -1;
+    }
+    if (ROB[rob].done) {
+        *value = ROB[rob].inst.EX_result;
+        return -1;
+    }
+    return rob;
+}
+
+// hands a finished result to every reservation station waiting on it
+static void oooBroadcast(int rob, int16_t value) {
+    for (int i = 0; i < RS_Size; ++i) {
+        struct rs_entry *rs = &RS[i];
+        if (!rs->busy) continue;
+        if (rs->qj == rob) {
+            ROB[rs->rob].inst.rs = value;
+            rs->qj = -1;
+        }
+        if (rs->qk == rob) {
+            ROB[rs->rob].inst.rt = value;
+            rs->qk = -1;
+        }
+    }
+}
+
+// loads a word for the load in ROB entry rob, forwarding from the youngest
+// older store to the same address that hasn't committed yet
+static int16_t oooLoad(int rob, long addr) {
+    for (int r = rob; r != ROB_Head;) {
+        r = (r + ROB_Size - 1) % ROB_Size;
+        if (ROB[r].inst.op == SW && ROB[r].inst.EX_result == addr) {
+            return ROB[r].inst.rt;
+        }
+    }
+    return (int16_t) loadWord(addr);
+}
+
+// the functional unit an op executes on
+static enum unit unitOf(enum inst_op op) {
+    switch (op) {
+        case MUL:
+            return UNIT_MUL;
+        case LW:
+        case SW:
+            return UNIT_LS;
+        default:
+            return UNIT_ALU;
+    }
+}
+
+// distance of a ROB entry from the head, i.e. how young it is
+static int robAge(int rob) {
+    return (rob - ROB_Head + ROB_Size) % ROB_Size;
+}
+
+// simulates one core of a multi-core run on the calling thread, which owns
+// every PER_CORE variable it touches
+static void *coreMain(void *arg) {
+    struct core *core = arg;
+    long sim_cycle = 0;
+
+    Core_Id = (int) (core - Cores);
+    Registers[26] = Core_Id; // $k0
+
+    while (!haltPassedWB) {
+        // only a cycle that wants the bus waits for the other cores
+        long request = EX_MEM_Flag
+                       && (EX_MEM_latch.op == LW || EX_MEM_latch.op == SW);
+        long holding = request && MEM_Inst_Cycles > 0;
+        atomic_store_explicit(&core->state,
+                              sim_cycle << 2 | request << 1 | holding,
+                              memory_order_release);
+        if (request) Bus_Owner = busGrant(sim_cycle);
+
+        HOOK_CYCLE(sim_cycle);
+        WB();
+        stageMEM(c, 1);
+        EX();
+        ID();
+        IF();
+        ++sim_cycle;
+    }
+
+    core->cycles = sim_cycle;
+    core->work[0] = IF_WorkCycles;
+    core->work[1] = ID_WorkCycles;
+    core->work[2] = EX_WorkCycles;
+    core->work[3] = MEM_WorkCycles;
+    core->work[4] = WB_WorkCycles;
+    core->retired = WB_Retired;
+    core->busStalls = BusStalls;
+    memcpy(core->registers, Registers, sizeof(Registers));
+    core->PC = PC;
+    atomic_store_explicit(&core->state, CORE_HALTED << 2, memory_order_release);
+    return NULL;
+}
+
+// waits until every core has reached cycle, which makes every request for
+// it known and every earlier DM access done, and returns the core the bus
+// is granted to on it; the first requester to get here arbitrates
+static int busGrant(long cycle) {
+    for (int k = 0; k < Core_Count; ++k) {
+        for (int spins = 0;
+             atomic_load_explicit(&Cores[k].state, memory_order_acquire) >> 2
+             < cycle; ++spins) {
+            if (spins >= Wait_Spins) sched_yield();
+        }
+    }
+
+    pthread_mutex_lock(&Bus_Mutex);
+    // a requester can't pass a cycle before it's arbitrated, so no core
+    // arbitrates a later cycle while one waits on this
+    if (Bus_Cycle != cycle) busArbitrate(cycle);
+    int owner = Bus_Granted;
+    pthread_mutex_unlock(&Bus_Mutex);
+    return owner;
+}
+
+// grants the bus for cycle: a core partway through an access keeps it,
+// otherwise it goes to the next requesting core after the last one granted
+// it; a core already past cycle didn't request it
+static void busArbitrate(long cycle) {
+    long state[MAX_CORES];
+    int owner = -1;
+
+    for (int k = 0; k < Core_Count; ++k) {
+        state[k] = atomic_load_explicit(&Cores[k].state, memory_order_acquire);
+        if (state[k] >> 2 != cycle) state[k] = 0;
+        if (state[k] & 1) owner = k;
+    }
+    for (int i = 1; owner < 0 && i <= Core_Count; ++i) {
+        int k = (Bus_Last + i) % Core_Count;
+        if (state[k] & 2) owner = Bus_Last = k;
+    }
+
+    Bus_Cycle = cycle;
+    Bus_Granted = owner;
+}
+
+// looks up the line holding pc, filling it on a miss and prefetching the
+// lines after it, and returns how many cycles the fetch takes
+static long icacheFetch(long pc) {
+    long line = pc / ICache->lineSize;
+    struct icache_line *set = ICache->lines
+                              + line % ICache->sets * ICache->ways;
+    long latency;
+    int way = 0;
+
+    while (way < ICache->ways && set[way].tag != line) ++way;
+    if (way < ICache->ways) {
+        struct icache_line hit = set[way];
+        ICache->hits++;
+        latency = hit.ready >= ICache->now ? hit.ready - ICache->now + 1 : 1;
+        if (hit.prefetched) {
+            ICache->usefulPrefetches++;
+            if (latency > 1) ICache->latePrefetches++;
+            hit.prefetched = 0;
+        }
+        // move to the front of the set
+        memmove(set + 1, set, way * sizeof(*set));
+        set[0] = hit;
+    } else {
+        ICache->misses++;
+        latency = ICache->missLatency;
+        icacheFill(line, ICache->now + latency - 1);
+        long *slot = icacheSlot();
+        if (slot) *slot = ICache->now + latency - 1;
+    }
+
+    // next-line prefetch along the sequential path, up to the end of IM,
+    // while a fill slot is free
+    for (long next = line + 1; next <= line + ICache->prefetch
+         && next * ICache->lineSize < 4L * IM_SIZE; ++next) {
+        struct icache_line *ways = ICache->lines
+                                   + next % ICache->sets * ICache->ways;
+        int present = 0;
+        for (int i = 0; i < ICache->ways; ++i) {
+            if (ways[i].tag == next) present = 1;
+        }
+        // in a small cache the line may share a set with the one fetched
+        // from, which mustn't be the way it replaces
+        if (present || ways[ICache->ways - 1].tag == line) continue;
+
+        long *slot = icacheSlot();
+        if (slot == NULL) break;
+        *slot = ICache->now + ICache->missLatency - 1;
+        icacheFill(next, *slot)->prefetched = 1;
+        ICache->prefetches++;
+    }
+
+    return latency;
+}
+
+// puts line at the front of its set, evicting the least recently used way
+static struct icache_line *icacheFill(long line, long ready) {
+    struct icache_line *set = ICache->lines
+                              + line % ICache->sets * ICache->ways;
+
+    memmove(set + 1, set, (ICache->ways - 1) * sizeof(*set));
+    set[0].tag = line;
+    set[0].ready = ready;
+    set[0].prefetched = 0;
+    return &set[0];
+}
+
+// a fill slot that's free this cycle, or NULL if every one is busy
+static long *icacheSlot(void) {
+    for (int i = 0; i < ICACHE_FILLS; ++i) {
+        if (ICache->fills[i] < ICache->now) return &ICache->fills[i];
+    }
+    return NULL;
+}
+
+#ifdef SIM_HOOKS
+// calls every hook registered at point, in the order they were added
+static void runHooks(enum hook_point point, const struct inst *inst) {
+    for (int i = 0; i < Hook_Count[point]; ++i) {
+        Hooks[point][i].fn(inst, Hook_Cycle, Hooks[point][i].data);
+    }
+}
+#endif
+
+// writes an IM entry in assembly syntax with numbered registers
+static void formatInst(char *buffer, size_t size, const struct im_inst *inst) {
+    static const char *names[] = {"err", "add", "addi", "beq", "beq", "lw",
+                                  "mul", "sub", "sw", "haltSimulation"};
+    const char *name = names[inst->op];
+
+    switch (inst->op) {
+        case ADD:
+        case SUB:
+        case MUL:
+            snprintf(buffer, size, "%s $%d, $%d, $%d", name, inst->rd,
+                     inst->rs, inst->rt);
+            break;
+        case ADDI:
+            snprintf(buffer, size, "%s $%d, $%d, %d", name, inst->rd,
+                     inst->rs, inst->immediate);
+            break;
+        case BEQ:
+            snprintf(buffer, size, "%s $%d, $%d, %d", name, inst->rt,
+                     inst->rs, inst->immediate);
+            break;
+        case LW:
+        case SW:
+            snprintf(buffer, size, "%s $%d, %d($%d)", name, inst->rt,
+                     inst->immediate, inst->rs);
+            break;
+        default:
+            snprintf(buffer, size, "%s", name);
+    }
+}
+
+// saves a line progScanner read, without its line break, as Source_Lines
+// entry Scanner_Line - 1
+static void keepSource(const char *line) {
+    if (Scanner_Line > Source_Cap) {
+        Source_Cap = Source_Cap ? 2 * Source_Cap : 256;
+        Source_Lines = realloc(Source_Lines, Source_Cap * sizeof(*Source_Lines));
+    }
+    char *copy = strdup(line);
+    copy[strcspn(copy, "\r\n")] = '\0';
+    Source_Lines[Scanner_Line - 1] = copy;
+}
+
+// replaces dst with src in the lanes where mask is set; vectors go by pointer
+// so none is passed in registers the target may not have
+static inline void blend(lane_t *dst, const lane_t *mask, const lane_t *src) {
+    *dst = (*mask & *src) | (~*mask & *dst);
+}
+
+// moves each lane of the 32-bit count amount into the matching 64-bit counter
+static inline void addWide(wide_t *counter, lane_t *amount) {
+    *counter += __builtin_convertvector(*amount, wide_t);
+    *amount = (lane_t) {0};
+}
+
+// advances every live lane by one cycle with the same rules as WB, MEM, EX,
+// ID and IF; lanes diverge only through the masks, never through branches
+static inline void laneCycle(struct lanes *restrict lanes,
+        const trace_t *restrict trace) {
+    const lane_t zero = {0};
+    // a lane at the end of the chunk waits out the cycle untouched
+    lane_t live = lanes->live & (TRACE_OP(lanes->ifNext) != TRACE_WAIT);
+    lane_t occ, op, done;
+
+    /* WB */
+    occ = lanes->memWbFlag & live;
+    op = lanes->memWbOp;
+    // masks are -1, so masking with 1 counts a cycle
+    lanes->wbAcc += occ & ((op == ADD) | (op == ADDI) | (op == SUB)
+                           | (op == MUL) | (op == LW)) & 1;
+    lanes->live &= ~(occ & (op == HALT));
+    lanes->memWbFlag &= ~occ;
+
+    /* MEM */
+    occ = lanes->exMemFlag & live;
+    op = lanes->exMemOp;
+    lane_t isMemOp = (op == LW) | (op == SW);
+    lanes->memCycles -= occ & isMemOp & (lanes->memCycles < lanes->c);
+    done = occ & (~isMemOp | (lanes->memCycles >= lanes->c))
+           & ~lanes->memWbFlag;
+    lanes->memAcc += done & isMemOp & lanes->c;
+    lanes->memCycles &= ~done;
+    blend(&lanes->memWbOp, &done, &op);
+    blend(&lanes->memWbDst, &done, &lanes->exMemDst);
+    lanes->memWbFlag |= done;
+    lanes->exMemFlag &= ~done;
+
+    /* EX */
+    occ = lanes->idExFlag & live;
+    op = lanes->idExOp;
+    lane_t latency = ((op == MUL) & lanes->m)
+                     | ((op != MUL) & (op != HALT) & lanes->n);
+    lane_t step = occ & (lanes->exCycles < latency);
+    lanes->exCycles -= step;
+    // resolved branches stop freezing IF
+    lane_t resolved = step & (lanes->exCycles == latency) & (op == BEQ);
+    const lane_t deadBeq = zero + DEADBEQ;
+    blend(&op, &resolved, &deadBeq);
+    lanes->idExOp = op;
+    done = occ & (lanes->exCycles >= latency) & ~lanes->exMemFlag;
+    lanes->exAcc += done & latency;
+    lanes->exCycles &= ~done;
+    blend(&lanes->exMemOp, &done, &op);
+    blend(&lanes->exMemDst, &done, &lanes->idExDst);
+    lanes->exMemFlag |= done;
+    lanes->idExFlag &= ~done;
+
+    /* ID */
+    occ = lanes->ifIdFlag & live & ~lanes->idExFlag;
+    lane_t pending = (lanes->idExFlag & lanes->idExDst)
+                     | (lanes->exMemFlag & lanes->exMemDst)
+                     | (lanes->memWbFlag & lanes->memWbDst);
+    done = occ & ((lanes->ifIdSrc & pending) == 0);
+    lanes->idAcc += done & (lanes->ifIdOp != HALT) & 1;
+    blend(&lanes->idExOp, &done, &lanes->ifIdOp);
+    blend(&lanes->idExDst, &done, &lanes->ifIdDst);
+    lanes->idExFlag |= done;
+    lanes->ifIdFlag &= ~done;
+
+    /* IF */
+    lane_t branch = (lanes->ifIdFlag & (lanes->ifIdOp == BEQ))
+                    | (lanes->idExFlag & (lanes->idExOp == BEQ));
+    lane_t active = live & ~lanes->ifHalt & ~branch;
+    lane_t next = lanes->ifNext;
+    lane_t nextOp = TRACE_OP(next);
+    lane_t isHalt = active & (nextOp == HALT);
+    lane_t fetching = active & ~isHalt;
+    lanes->ifCycles -= fetching & (lanes->ifCycles < lanes->c);
+    done = (isHalt | (fetching & (lanes->ifCycles >= lanes->c)))
+           & ~lanes->ifIdFlag;
+    lanes->ifAcc += done & ~isHalt & lanes->c;
+    lanes->ifCycles &= ~done;
+    lanes->ifHalt |= done & isHalt;
+    lanes->ifIdx -= done;
+    // register numbers to masks; $zero's bit is dropped, it's never a hazard
+    const lane_t one = zero + 1;
+    lane_t nextDst = (one << TRACE_DST(next)) & ~one;
+    lane_t nextSrc = ((one << TRACE_SRC1(next)) | (one << TRACE_SRC2(next)))
+                     & ~one;
+    blend(&lanes->ifIdOp, &done, &nextOp);
+    blend(&lanes->ifIdDst, &done, &nextDst);
+    blend(&lanes->ifIdSrc, &done, &nextSrc);
+    lanes->ifIdFlag |= done;
+    // the only per-lane scalar work, and only in cycles where a lane fetched
+    if (anyLive(&done)) {
+        for (int l = 0; l < LANES; ++l) {
+            lanes->ifNext[l] = (int32_t) trace[lanes->ifIdx[l]];
+        }
+    }
+
+    lanes->cycleAcc += live & 1;
+}
+
+// advances each live lane over the cycles until its next one in which a
+// stage finishes, fetches, issues or leaves WB; in those cycles the lane only
+// counts up towards its latencies, so it takes them in one step, and since
+// lanes never interact each skips as far as it can on its own
+static inline void laneSkip(struct lanes *restrict lanes) {
+    const lane_t zero = {0};
+    const lane_t far = zero + INT32_MAX;
+    lane_t live = lanes->live & (TRACE_OP(lanes->ifNext) != TRACE_WAIT);
+    lane_t event = lanes->memWbFlag;
+    lane_t free = far; // cycles each lane can skip
+    lane_t left, fewer;
+
+    /* MEM */
+    lane_t isMemOp = (lanes->exMemOp == LW) | (lanes->exMemOp == SW);
+    event |= lanes->exMemFlag & ~isMemOp;
+    lane_t memTicks = lanes->exMemFlag & isMemOp
+                      & (lanes->memCycles < lanes->c);
+    left = lanes->c - lanes->memCycles - 1;
+    blend(&free, &memTicks, &left);
+
+    /* EX */
+    lane_t op = lanes->idExOp;
+    lane_t latency = ((op == MUL) & lanes->m)
+                     | ((op != MUL) & (op != HALT) & lanes->n);
+    event |= lanes->idExFlag & (lanes->exCycles >= latency)
+             & ~lanes->exMemFlag;
+    lane_t exTicks = lanes->idExFlag & (lanes->exCycles < latency);
+    left = latency - lanes->exCycles - 1;
+    fewer = exTicks & (left < free);
+    blend(&free, &fewer, &left);
+
+    /* ID */
+    lane_t pending = (lanes->idExFlag & lanes->idExDst)
+                     | (lanes->exMemFlag & lanes->exMemDst)
+                     | (lanes->memWbFlag & lanes->memWbDst);
+    event |= lanes->ifIdFlag & ~lanes->idExFlag
+             & ((lanes->ifIdSrc & pending) == 0);
+
+    /* IF */
+    lane_t branch = (lanes->ifIdFlag & (lanes->ifIdOp == BEQ))
+                    | (lanes->idExFlag & (lanes->idExOp == BEQ));
+    lane_t active = ~lanes->ifHalt & ~branch;
+    lane_t isHalt = active & (TRACE_OP(lanes->ifNext) == HALT);
+    lane_t fetching = active & ~isHalt;
+    event |= (isHalt | (fetching & (lanes->ifCycles >= lanes->c)))
+             & ~lanes->ifIdFlag;
+    lane_t ifTicks = fetching & (lanes->ifCycles < lanes->c);
+    left = lanes->c - lanes->ifCycles - 1;
+    fewer = ifTicks & (left < free);
+    blend(&free, &fewer, &left);
+
+    // a live lane always has something ticking or happening, but don't
+    // count on it
+    free &= live & ~event & ~(free == far);
+    // every count stays below its latency, so the cycle after still runs
+    lanes->memCycles += memTicks & free;
+    lanes->exCycles += exTicks & free;
+    lanes->ifCycles += ifTicks & free;
+    lanes->cycleAcc += free;
+}
+
+// whether any lane is still running
+static inline int anyLive(const lane_t *live) {
+    int any = 0;
+    for (int l = 0; l < LANES; ++l) any |= (*live)[l];
+    return any;
+}
+
+// packs what the sweep engine needs of an instruction into a trace word
+static trace_t traceWord(const struct inst *inst) {
+    trace_t word = inst->op;
+    if (writesReg(inst->op)) word |= (trace_t) inst->rd << 4;
+    switch (inst->op) {
+        case ADD:
+        case SUB:
+        case MUL:
+        case BEQ:
+        case SW:
+            word |= (trace_t) inst->rt << 14;
+            // fall through
+        case ADDI:
+        case LW:
+            word |= (trace_t) inst->rs << 9;
+            break;
+        default:
+            break;
+    }
+    return word;
+}
+
+// orders configurations by an estimate of their cycle count, the work their
+// latencies give IF, EX and MEM over the trace, so that each group of LANES
+// runs about as long as its slowest lane
+static void sweepOrder(const long *ops, const int *configs, int count,
+        int *order) {
+    long traceLen = 0;
+    double cost[count];
+
+    for (int op = 0; op <= HALT; ++op) traceLen += ops[op];
+    for (int i = 0; i < count; ++i) {
+        const int *config = configs + 3 * i;
+        cost[i] = (double) traceLen * config[2] + (double) ops[MUL] * config[0]
+                  + (double) (ops[ADD] + ops[ADDI] + ops[SUB] + ops[BEQ]
+                              + ops[LW] + ops[SW]) * config[1]
+                  + (double) (ops[LW] + ops[SW]) * config[2];
+    }
+
+    // insertion sort, there are at most a few hundred configurations
+    for (int i = 0; i < count; ++i) {
+        int j = i;
+        while (j > 0 && cost[order[j - 1]] > cost[i]) {
+            order[j] = order[j - 1];
+            --j;
+        }
+        order[j] = i;
+    }
+}
+
+// parses a comma separated list of m:n:c tuples into configs, returning how
+// many were read or -1 if the list is malformed
+static int parseSweep(char *list, int *configs, int max) {
+    int count = 0;
+    char *cur = list;
+
+    while (*cur) {
+        if (count == max) return -1;
+        for (int field = 0; field < 3; ++field) {
+            char *end;
+            long value = strtol(cur, &end, 10);
+            if (end == cur || value < 1 || value > INT_MAX) return -1;
+            configs[3 * count + field] = (int) value;
+            cur = end;
+            if (field < 2 && *cur++ != ':') return -1;
+        }
+        ++count;
+        if (*cur == ',') ++cur;
+        else if (*cur) return -1;
+    }
+
+    return count;
+}
+
+/* ============================= Observer Hooks ============================= */
+#ifdef SIM_HOOKS
+#include SIM_HOOKS
+#endif
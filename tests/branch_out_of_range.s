@@ -0,0 +1,3 @@
+add $t0, $zero, $zero
+beq $zero, $zero, -100
+haltSimulation
@@ -0,0 +1,12 @@
+addi $s0, $zero, 12
+addi $t0, $zero, 5
+addi $t1, $zero, 0
+add $t1, $t1, $t0
+mul $t2, $t1, $t0
+sub $t3, $t2, $t1
+sw $t3, 4($s0)
+lw $t4, 4($s0)
+addi $t0, $t0, -1
+beq $t0, $zero, 1
+beq $zero, $zero, -8
+haltSimulation
@@ -0,0 +1,15 @@
+addi $t0, $zero, 8000
+addi $s1, $zero, 23
+addi $s0, $zero, 0
+add $t1, $t1, $t0
+mul $t2, $t0, $t0
+sw $t2, 0($s0)
+beq $t0, $s1, 2
+lw $t3, 0($s0)
+beq $zero, $zero, 2
+mul $t4, $t2, $t1
+sw $t4, 4($s0)
+addi $t0, $t0, -1
+beq $t0, $zero, 1
+beq $zero, $zero, -11
+haltSimulation
@@ -0,0 +1,103 @@
+#!/bin/sh
+# Builds the simulator and checks that programs branching outside IM stop with
+# an error instead of fetching from outside the array, and that the modes that
+# only change how a run is simulated give the same output as a plain run.
+set -e
+root=$(cd "$(dirname "$0")/.." && pwd)
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+cc -O2 -o "$work/sim-mips" "$root/mips_sim.c" -lm -lpthread
+# the same simulator without the loops compiled for fixed latencies
+cc -O2 '-DSPECIALIZED_LATENCIES(X)=' -o "$work/sim-generic" \
+    "$root/mips_sim.c" -lm -lpthread
+
+failed=0
+for mode in "" --sample=100:20:10 --sweep=2:2:2 --ooo=4:8:2; do
+    # a regression used to fetch from outside IM and never halt
+    if timeout 10 "$work/sim-mips" -b 1 1 1 "$root/tests/branch_out_of_range.s" \
+            "$work/out.txt" $mode > /dev/null 2> "$work/err.txt"; then
+        echo "FAIL branch_out_of_range $mode: exited successfully"
+        failed=1
+    elif ! grep -q "PC is outside the program: -392" "$work/err.txt"; then
+        echo "FAIL branch_out_of_range $mode: $(cat "$work/err.txt")"
+        failed=1
+    else
+        echo "ok   branch_out_of_range $mode"
+    fi
+done
+
+# runs sim on prog at the m:n:c in cfg with any further options, leaving the
+# output file in $work/name.txt and what it prints, past the line echoing the
+# arguments, in $work/name.out
+run() {
+    name=$1 sim=$2 prog=$3 cfg=$4
+    shift 4
+    timeout 10 "$sim" -b $(echo "$cfg" | tr : ' ') "$prog" "$work/$name.txt" \
+        "$@" | sed 1d > "$work/$name.out"
+}
+
+# reports whether runs a and b wrote and printed the same bytes
+same() {
+    if cmp -s "$work/a.txt" "$work/b.txt" && cmp -s "$work/a.out" "$work/b.out"
+    then
+        echo "ok   $1"
+    else
+        echo "FAIL $1: output differs"
+        failed=1
+    fi
+}
+
+# the loop takes another path in one of its last iterations, which loop
+# skipping has to stop for and pick up after; it also runs for more
+# instructions than the sweep traces at a time
+loop="$root/tests/loop_diverge.s"
+for cfg in 1:1:1 2:1:1 4:2:4 3:2:4 1:3:2 2:2:8; do
+    run a "$work/sim-mips" "$loop" $cfg
+    run b "$work/sim-mips" "$loop" $cfg --skip-loops
+    same "loop_diverge $cfg --skip-loops"
+    run b "$work/sim-mips" "$loop" $cfg --stream
+    same "loop_diverge $cfg --stream"
+    run b "$work/sim-generic" "$loop" $cfg
+    same "loop_diverge $cfg without specialized loops"
+done
+
+# every line of a sweep against a run of its configuration on its own; nine
+# configurations take more than one group of lanes
+configs=2:1:1,4:2:4,3:2:4,1:3:2,2:2:8,8:1:3,1:8:1,5:5:5
+timeout 10 "$work/sim-mips" -b 1 1 1 "$loop" "$work/sweep.txt" \
+    --sweep=$configs > /dev/null
+for cfg in 1:1:1 $(echo $configs | tr , ' '); do
+    run a "$work/sim-mips" "$loop" $cfg
+    mnc=$(echo $cfg | tr : ' ')
+    util=$(sed -n 's/^stage utilization: //p' "$work/a.txt" | sed 's/ *$//')
+    cycles=$(sed -n 's/^Total CPU Cycles: //p' "$work/a.out")
+    if ! grep -qxF "m n c: $mnc stage utilization: $util total cycles: $cycles" \
+            "$work/sweep.txt"; then
+        echo "FAIL loop_diverge --sweep $cfg: line differs from a single run"
+        failed=1
+    elif [ "$(grep '^register values' "$work/a.txt")" \
+            != "$(grep '^register values' "$work/sweep.txt")" ]; then
+        echo "FAIL loop_diverge --sweep $cfg: registers differ"
+        failed=1
+    else
+        echo "ok   loop_diverge --sweep $cfg"
+    fi
+done
+
+# machine code assembled from encodings.s as raw big and little endian words
+# and as a big endian ELF object, which is detected without --format
+for input in encodings.bin:--format=raw encodings.el.bin:--format=rawel \
+        encodings.elf:; do
+    file=${input%%:*} format=${input#*:}
+    for cfg in 1:1:1 3:2:4; do
+        run a "$work/sim-mips" "$root/tests/encodings.s" $cfg
+        run b "$work/sim-mips" "$root/tests/$file" $cfg $format
+        # everything but the program name
+        for out in a.txt a.out b.txt b.out; do
+            sed -i '/^[Pp]rogram name: /d' "$work/$out"
+        done
+        same "$file $cfg"
+    done
+done
+exit $failed